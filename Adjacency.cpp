@@ -0,0 +1,75 @@
+#include "Adjacency.h"
+#include "Parallel.h"
+
+void VertexFaces::build(const std::vector<glm::ivec3> &faces, size_t numVertices, int numThreads){
+    size_t numFaces = faces.size();
+    int numChunks = (int)((numFaces + ADJACENCY_CHUNK - 1) / ADJACENCY_CHUNK);
+    // Vertices v >> blockShift share a block
+    int blockShift = 0;
+    while((numVertices >> blockShift) >= ADJACENCY_BLOCKS){
+        blockShift++;
+    }
+    int numBlocks = (int)(numVertices >> blockShift) + 1;
+
+    // Corners of every block in every chunk, then where they go: blocks one after the other,
+    // and within a block the chunks in order
+    std::vector<uint32_t> start((size_t)numChunks * numBlocks, 0);
+    parallelFor(numThreads, numChunks, [&](int chunk){
+        uint32_t *count = start.data() + (size_t)chunk * numBlocks;
+        size_t end = std::min((size_t)(chunk + 1) * ADJACENCY_CHUNK, numFaces);
+        for(size_t f = (size_t)chunk * ADJACENCY_CHUNK; f < end; f++){
+            for(int k = 0; k < 3; k++){
+                count[faces[f][k] >> blockShift]++;
+            }
+        }
+    });
+    std::vector<uint32_t> blockStart(numBlocks + 1, 0);
+    uint32_t total = 0;
+    for(int b = 0; b < numBlocks; b++){
+        blockStart[b] = total;
+        for(int chunk = 0; chunk < numChunks; chunk++){
+            uint32_t count = start[(size_t)chunk * numBlocks + b];
+            start[(size_t)chunk * numBlocks + b] = total;
+            total += count;
+        }
+    }
+    blockStart[numBlocks] = total;
+
+    // The vertex and face of every corner, grouped by block
+    std::vector<uint32_t> cornerVertex(total), cornerFace(total);
+    parallelFor(numThreads, numChunks, [&](int chunk){
+        uint32_t *next = start.data() + (size_t)chunk * numBlocks;
+        size_t end = std::min((size_t)(chunk + 1) * ADJACENCY_CHUNK, numFaces);
+        for(size_t f = (size_t)chunk * ADJACENCY_CHUNK; f < end; f++){
+            for(int k = 0; k < 3; k++){
+                uint32_t v = (uint32_t)faces[f][k];
+                uint32_t i = next[v >> blockShift]++;
+                cornerVertex[i] = v;
+                cornerFace[i] = (uint32_t)f;
+            }
+        }
+    });
+
+    // Sort every block by vertex, the rows of the block start where the block does
+    offsets.assign(numVertices + 1, 0);
+    ids.resize(total);
+    parallelFor(numThreads, numBlocks, [&](int b){
+        size_t first = (size_t)b << blockShift, last = std::min((size_t)(b + 1) << blockShift, numVertices);
+        if(first >= last)
+            return;
+        std::vector<uint32_t> next(last - first, 0);
+        for(uint32_t i = blockStart[b]; i < blockStart[b + 1]; i++){
+            next[cornerVertex[i] - first]++;
+        }
+        uint32_t row = blockStart[b];
+        for(size_t v = first; v < last; v++){
+            uint32_t degree = next[v - first];
+            offsets[v] = next[v - first] = row;
+            row += degree;
+        }
+        for(uint32_t i = blockStart[b]; i < blockStart[b + 1]; i++){
+            ids[next[cornerVertex[i] - first]++] = cornerFace[i];
+        }
+    });
+    offsets[numVertices] = total;
+}
@@ -0,0 +1,36 @@
+#ifndef ADJACENCY_H
+#define ADJACENCY_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <stdint.h>
+
+// Faces around every vertex of a triangle mesh, stored as compressed rows: the faces of vertex v
+// are faceIds()[rowOffsets()[v]] to faceIds()[rowOffsets()[v + 1] - 1], in ascending order. A face
+// naming a vertex twice is in its row twice.
+
+// Built by a counting sort of the face corners in two levels, on numThreads threads. The corners
+// are first scattered by blocks of consecutive vertices, chunk by chunk of faces, then every block
+// is sorted by vertex on its own. Both scatters keep the order of the faces, so the rows are the
+// same for any number of threads.
+#define ADJACENCY_CHUNK (1 << 16)
+#define ADJACENCY_BLOCKS 1024
+
+class VertexFaces{
+public:
+    void build(const std::vector<glm::ivec3> &faces, size_t numVertices, int numThreads);
+
+    size_t numVertices() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    uint32_t degree(uint32_t v) const { return offsets[v + 1] - offsets[v]; }
+    const uint32_t *begin(uint32_t v) const { return ids.data() + offsets[v]; }
+    const uint32_t *end(uint32_t v) const { return ids.data() + offsets[v + 1]; }
+
+    const std::vector<uint32_t> &rowOffsets() const { return offsets; }
+    const std::vector<uint32_t> &faceIds() const { return ids; }
+
+private:
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> ids;
+};
+
+#endif
@@ -11,14 +11,12 @@
 
 // Initialize GL and the attributes of Application
 
-void Application::init(TileMap _tilemap, bool computeViz)
+void Application::init(TileMap tilemap, bool computeViz, const VisibilitySettings &visibilitySettings)
 {
 	bPlay = true;
 	glClearColor(1.f, 1.f, 1.f, 1.0f); // Background = white color
 	glEnable(GL_CULL_FACE);
 	glEnable(GL_DEPTH_TEST);
-	// Initialize the scene object
-	tilemap = _tilemap;
 
 	// State attributes needed to track keyboard & mouse
 	for (unsigned int i = 0; i < 256; i++)
@@ -33,12 +31,16 @@ void Application::init(TileMap _tilemap, bool computeViz)
 	previousMousePos = glm::ivec2(glutGet(GLUT_WINDOW_WIDTH) / 2, glutGet(GLUT_WINDOW_HEIGHT) / 2);
 	glutWarpPointer(previousMousePos.x, previousMousePos.y);
 
-	if(computeViz){
+	// In lazy mode the scene computes the rows as the camera moves, the portals need none
+	if(computeViz && !visibilitySettings.lazy && !visibilitySettings.portals){
+		// After an edit of the map only the rows that can see the edited tiles are recomputed
 		Visibility vis;
-		vis.computeVisibility("../../map/visibility.txt", tilemap);
+		if(!visibilitySettings.incremental || !vis.updateVisibility("../../map/visibility.pvs", tilemap, visibilitySettings))
+			vis.computeVisibility("../../map/visibility.pvs", tilemap, visibilitySettings);
 	}
 
-	scene.init(tilemap);
+	// The scene keeps the tilemap
+	scene.init(std::move(tilemap), visibilitySettings);
 }
 
 // Load the mesh into the scene
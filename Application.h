@@ -24,7 +24,7 @@ public:
 		return G;
 	}
 	
-	void init(TileMap tilemap, bool computeViz);
+	void init(TileMap tilemap, bool computeViz, const VisibilitySettings &visibilitySettings);
 	bool loadMesh(const char *filename, uint8_t id);
 	bool update(int deltaTime);
 	void render();
@@ -60,7 +60,6 @@ private:
 	int16_t framecounter = 0; 
 	int16_t num_instances = 1;        
 	float fps = 60.0f;    
-	TileMap tilemap;                     
 };
 
 
@@ -0,0 +1,416 @@
+#include "EdgeCollapse.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Heap position of an edge that is not in the heap, or id of nothing
+#define NO_ID UINT32_MAX
+// Edges evaluated by one job of init
+#define COLLAPSE_CHUNK (1 << 14)
+
+static inline bool hasVertex(const glm::ivec3 &f, uint32_t v){
+    return (uint32_t)f[0] == v || (uint32_t)f[1] == v || (uint32_t)f[2] == v;
+}
+
+void EdgeCollapse::init(const std::vector<glm::vec3> &vertices, const std::vector<glm::ivec3> &faces, const VertexFaces &adjacency,
+                        const std::vector<Quadric> &quadrics, int numThreads){
+    uint32_t numVertices = (uint32_t)vertices.size();
+    position = vertices;
+    quadric = quadrics;
+    face = faces;
+    faceAlive.assign(faces.size(), 1);
+    liveFaces = 0;
+    for(size_t f = 0; f < faces.size(); f++){
+        // Faces naming a vertex twice are dropped right away
+        faceAlive[f] = faces[f][0] != faces[f][1] && faces[f][1] != faces[f][2] && faces[f][0] != faces[f][2];
+        liveFaces += faceAlive[f];
+    }
+
+    // The face lists start as the rows of the adjacency
+    vertexFaces.data = adjacency.faceIds();
+    vertexFaces.first.assign(adjacency.rowOffsets().begin(), adjacency.rowOffsets().end() - 1);
+    vertexFaces.count.resize(numVertices);
+    for(uint32_t v = 0; v < numVertices; v++){
+        vertexFaces.count[v] = adjacency.degree(v);
+    }
+    vertexFaces.live = vertexFaces.data.size();
+
+    // Every vertex makes the edges to the vertices of higher id on its faces. mark[w] is the last
+    // edge made to w, and a face of its own is kept for the edges of a single face.
+    edges.clear();
+    mark.assign(numVertices, NO_ID);
+    std::vector<uint32_t> edgeFaces, borderFace;
+    // A closed mesh has 3/2 edges per face, a mesh with borders a few more
+    size_t expectedEdges = faces.size() * 3 / 2 + faces.size() / 16;
+    edges.reserve(expectedEdges);
+    edgeFaces.reserve(expectedEdges);
+    borderFace.reserve(expectedEdges);
+    for(uint32_t v = 0; v < numVertices; v++){
+        for(const uint32_t *f = adjacency.begin(v); f != adjacency.end(v); f++){
+            if(!faceAlive[*f])
+                continue;
+            for(int k = 0; k < 3; k++){
+                uint32_t w = (uint32_t)face[*f][k];
+                if(w <= v)
+                    continue;
+                uint32_t e = mark[w];
+                if(e == NO_ID || edges[e].v[0] != v){
+                    e = (uint32_t)edges.size();
+                    edges.push_back(Edge{{v, w}, 0.0f, glm::vec3(0.0f)});
+                    edgeFaces.push_back(0);
+                    borderFace.push_back(*f);
+                    mark[w] = e;
+                }
+                edgeFaces[e]++;
+            }
+        }
+    }
+    uint32_t numEdges = (uint32_t)edges.size();
+
+    // Planes through the border edges, perpendicular to their face
+    QuadricReal weight = (QuadricReal)std::sqrt(COLLAPSE_BORDER_WEIGHT);
+    for(uint32_t e = 0; e < numEdges; e++){
+        if(edgeFaces[e] != 1)
+            continue;
+        const glm::ivec3 &f = face[borderFace[e]];
+        glm::vec3 normal = glm::cross(position[f[1]] - position[f[0]], position[f[2]] - position[f[0]]);
+        glm::vec3 along = position[edges[e].v[1]] - position[edges[e].v[0]];
+        glm::vec3 across = glm::cross(along, normal);
+        float length = glm::length(across);
+        if(length == 0.0f)
+            continue;
+        across /= length;
+        Quadric K = Quadric::plane(weight * across.x, weight * across.y, weight * across.z,
+                                   -weight * glm::dot(across, position[edges[e].v[0]]));
+        quadric[edges[e].v[0]] += K;
+        quadric[edges[e].v[1]] += K;
+    }
+
+    // The edge lists of all vertices, in the order of the edges
+    vertexEdges.first.assign(numVertices, 0);
+    vertexEdges.count.assign(numVertices, 0);
+    for(const Edge &edge : edges){
+        vertexEdges.count[edge.v[0]]++;
+        vertexEdges.count[edge.v[1]]++;
+    }
+    uint32_t total = 0;
+    for(uint32_t v = 0; v < numVertices; v++){
+        vertexEdges.first[v] = total;
+        total += vertexEdges.count[v];
+        vertexEdges.count[v] = 0;
+    }
+    vertexEdges.data.resize(total);
+    vertexEdges.live = total;
+    for(uint32_t e = 0; e < numEdges; e++){
+        for(int k = 0; k < 2; k++){
+            uint32_t v = edges[e].v[k];
+            vertexEdges.data[vertexEdges.first[v] + vertexEdges.count[v]++] = e;
+        }
+    }
+
+    edgeAlive.assign(numEdges, 1);
+    edgeFallback.assign(numEdges, 0);
+    int numChunks = (int)((numEdges + COLLAPSE_CHUNK - 1) / COLLAPSE_CHUNK);
+    parallelFor(numThreads, numChunks, [&](int chunk){
+        uint32_t end = std::min((uint32_t)(chunk + 1) * COLLAPSE_CHUNK, numEdges);
+        for(uint32_t e = (uint32_t)chunk * COLLAPSE_CHUNK; e < end; e++){
+            evaluate(e);
+        }
+    });
+    heap.resize(numEdges);
+    heapPos.resize(numEdges);
+    for(uint32_t e = 0; e < numEdges; e++){
+        heap[e] = HeapEntry{edges[e].cost, e};
+        heapPos[e] = e;
+    }
+    for(uint32_t i = numEdges / 2; i-- > 0;){
+        siftDown(i);
+    }
+    mark.assign(numVertices, 0);
+    stamp = 0;
+}
+
+void EdgeCollapse::simplify(size_t targetFaces){
+    while(liveFaces > targetFaces && !heap.empty()){
+        uint32_t e = heap[0].edge;
+        heapPop();
+        // Rejected edges come back when one of their vertices changes
+        if(canCollapse(e))
+            collapse(e);
+    }
+}
+
+void EdgeCollapse::extract(std::vector<glm::vec3> &lod_vertices, std::vector<glm::ivec3> &lod_faces) const{
+    std::vector<uint32_t> newId(position.size(), NO_ID);
+    for(size_t f = 0; f < face.size(); f++){
+        if(faceAlive[f]){
+            newId[face[f][0]] = newId[face[f][1]] = newId[face[f][2]] = 0;
+        }
+    }
+    lod_vertices.clear();
+    for(size_t v = 0; v < position.size(); v++){
+        if(newId[v] != NO_ID){
+            newId[v] = (uint32_t)lod_vertices.size();
+            lod_vertices.push_back(position[v]);
+        }
+    }
+    lod_faces.clear();
+    for(size_t f = 0; f < face.size(); f++){
+        if(faceAlive[f])
+            lod_faces.push_back(glm::ivec3(newId[face[f][0]], newId[face[f][1]], newId[face[f][2]]));
+    }
+}
+
+// The cost of an edge is the error of its summed quadric at its point of least error, found as in
+// the clusters of the octree: the solution of A x = -b, if A is well conditioned, otherwise the
+// best of the two vertices and the middle of the edge
+
+void EdgeCollapse::evaluate(uint32_t e){
+    Edge &edge = edges[e];
+    Quadric q = quadric[edge.v[0]];
+    q += quadric[edge.v[1]];
+    double a00 = q.q[0], a01 = q.q[1], a02 = q.q[2], a11 = q.q[4], a12 = q.q[5], a22 = q.q[7];
+    double b0 = q.q[3], b1 = q.q[6], b2 = q.q[8];
+    double c00 = a11 * a22 - a12 * a12, c01 = a02 * a12 - a01 * a22, c02 = a01 * a12 - a02 * a11;
+    double c11 = a00 * a22 - a02 * a02, c12 = a01 * a02 - a00 * a12, c22 = a00 * a11 - a01 * a01;
+    double det = a00 * c00 + a01 * c01 + a02 * c02;
+    double meanEigen = (a00 + a11 + a22) / 3;
+    if(meanEigen > 0 && det > QEM_MIN_CONDITION * meanEigen * meanEigen * meanEigen){
+        double scale = -1 / det;
+        edge.target = glm::vec3((c00 * b0 + c01 * b1 + c02 * b2) * scale,
+                                (c01 * b0 + c11 * b1 + c12 * b2) * scale,
+                                (c02 * b0 + c12 * b1 + c22 * b2) * scale);
+        edge.cost = (float)q.error(edge.target);
+        edgeFallback[e] = 0;
+    }
+    else{
+        glm::vec3 candidates[3] = {position[edge.v[0]], position[edge.v[1]],
+                                   0.5f * (position[edge.v[0]] + position[edge.v[1]])};
+        edge.cost = std::numeric_limits<float>::infinity();
+        for(const glm::vec3 &p : candidates){
+            float cost = (float)q.error(p);
+            if(cost < edge.cost){
+                edge.cost = cost;
+                edge.target = p;
+            }
+        }
+        edgeFallback[e] = 1;
+    }
+    // Rounding can take the error a little below 0
+    edge.cost = std::max(0.0f, edge.cost);
+}
+
+bool EdgeCollapse::keepsOrientation(uint32_t f, uint32_t v, const glm::vec3 &target) const{
+    glm::vec3 p[3], moved[3];
+    for(int k = 0; k < 3; k++){
+        p[k] = position[face[f][k]];
+        moved[k] = ((uint32_t)face[f][k] == v) ? target : p[k];
+    }
+    glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+    glm::vec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+    float lengthBefore = glm::dot(before, before);
+    if(lengthBefore == 0.0f)
+        return true;
+    float cosine = glm::dot(before, after);
+    return cosine > 0.0f && cosine * cosine >= COLLAPSE_MIN_COS * COLLAPSE_MIN_COS * lengthBefore * glm::dot(after, after);
+}
+
+bool EdgeCollapse::canCollapse(uint32_t e){
+    uint32_t a = edges[e].v[0], b = edges[e].v[1];
+    // The vertices next to both a and b must be the third vertices of the faces on the edge
+    stamp++;
+    for(const uint32_t *ea = vertexEdges.begin(a); ea != vertexEdges.end(a); ea++){
+        if(edgeAlive[*ea])
+            mark[edges[*ea].v[0] ^ edges[*ea].v[1] ^ a] = stamp;
+    }
+    int common = 0, shared = 0;
+    for(const uint32_t *eb = vertexEdges.begin(b); eb != vertexEdges.end(b); eb++){
+        if(edgeAlive[*eb])
+            common += mark[edges[*eb].v[0] ^ edges[*eb].v[1] ^ b] == stamp;
+    }
+    for(const uint32_t *f = vertexFaces.begin(a); f != vertexFaces.end(a); f++){
+        if(faceAlive[*f])
+            shared += hasVertex(face[*f], b);
+    }
+    if(common != shared)
+        return false;
+
+    // No face that stays may turn over
+    for(uint32_t v : {a, b}){
+        for(const uint32_t *f = vertexFaces.begin(v); f != vertexFaces.end(v); f++){
+            if(faceAlive[*f] && !hasVertex(face[*f], a ^ b ^ v) && !keepsOrientation(*f, v, edges[e].target))
+                return false;
+        }
+    }
+    return true;
+}
+
+void EdgeCollapse::collapse(uint32_t e){
+    uint32_t keep = edges[e].v[0], gone = edges[e].v[1];
+    position[keep] = edges[e].target;
+    quadric[keep] += quadric[gone];
+
+    // The faces on the edge die, the other faces of gone move to keep
+    scratch.clear();
+    for(const uint32_t *f = vertexFaces.begin(keep); f != vertexFaces.end(keep); f++){
+        if(!faceAlive[*f])
+            continue;
+        if(hasVertex(face[*f], gone)){
+            faceAlive[*f] = 0;
+            liveFaces--;
+        }
+        else
+            scratch.push_back(*f);
+    }
+    for(const uint32_t *f = vertexFaces.begin(gone); f != vertexFaces.end(gone); f++){
+        if(!faceAlive[*f])
+            continue;
+        for(int k = 0; k < 3; k++){
+            if((uint32_t)face[*f][k] == gone)
+                face[*f][k] = keep;
+        }
+        scratch.push_back(*f);
+    }
+    vertexFaces.assign(keep, scratch);
+
+    // The edges of gone move to keep, unless keep already has an edge to the same vertex
+    stamp++;
+    edgeAlive[e] = 0;
+    scratch.clear();
+    for(const uint32_t *ek = vertexEdges.begin(keep); ek != vertexEdges.end(keep); ek++){
+        if(edgeAlive[*ek]){
+            mark[edges[*ek].v[0] ^ edges[*ek].v[1] ^ keep] = stamp;
+            scratch.push_back(*ek);
+        }
+    }
+    for(const uint32_t *eg = vertexEdges.begin(gone); eg != vertexEdges.end(gone); eg++){
+        if(!edgeAlive[*eg])
+            continue;
+        Edge &edge = edges[*eg];
+        uint32_t other = edge.v[0] ^ edge.v[1] ^ gone;
+        if(mark[other] == stamp){
+            edgeAlive[*eg] = 0;
+            if(heapPos[*eg] != NO_ID)
+                heapRemove(*eg);
+            continue;
+        }
+        edge.v[edge.v[0] == gone ? 0 : 1] = keep;
+        mark[other] = stamp;
+        scratch.push_back(*eg);
+    }
+    vertexEdges.assign(keep, scratch);
+
+    scratch.clear();
+    vertexFaces.assign(gone, scratch);
+    vertexEdges.assign(gone, scratch);
+
+    // The edges of keep are evaluated again while their vertices are at hand. An edge whose cost
+    // went up moves down the heap from where it is, which for most edges is near the bottom. The
+    // least error of the summed quadrics can only go up, so a cost that went down is rounding and
+    // the edge keeps its place, unless the cost came from the fallback of evaluate, whose
+    // candidate points move with keep.
+    for(const uint32_t *ek = vertexEdges.begin(keep); ek != vertexEdges.end(keep); ek++){
+        float before = edges[*ek].cost;
+        bool fallback = edgeFallback[*ek];
+        evaluate(*ek);
+        if(heapPos[*ek] == NO_ID)
+            heapPush(*ek);
+        else if(edges[*ek].cost > before || fallback)
+            heapUpdate(*ek);
+    }
+}
+
+void EdgeCollapse::ListArena::assign(uint32_t v, const std::vector<uint32_t> &ids){
+    live -= count[v];
+    count[v] = 0;
+    // Compact once more than half of data is stale
+    if(data.size() > 2 * live + (1 << 16)){
+        std::vector<uint32_t> compacted;
+        compacted.reserve(2 * live);
+        for(size_t u = 0; u < first.size(); u++){
+            uint32_t start = (uint32_t)compacted.size();
+            compacted.insert(compacted.end(), data.begin() + first[u], data.begin() + first[u] + count[u]);
+            first[u] = start;
+        }
+        data.swap(compacted);
+    }
+    first[v] = (uint32_t)data.size();
+    count[v] = (uint32_t)ids.size();
+    data.insert(data.end(), ids.begin(), ids.end());
+    live += ids.size();
+}
+
+void EdgeCollapse::heapPush(uint32_t e){
+    heap.push_back(HeapEntry{edges[e].cost, e});
+    siftUp((uint32_t)heap.size() - 1);
+}
+
+void EdgeCollapse::heapPop(){
+    heapPos[heap[0].edge] = NO_ID;
+    HeapEntry last = heap.back();
+    heap.pop_back();
+    if(!heap.empty()){
+        heap[0] = last;
+        heapPos[last.edge] = 0;
+        siftDown(0);
+    }
+}
+
+void EdgeCollapse::heapUpdate(uint32_t e){
+    uint32_t i = heapPos[e];
+    float before = heap[i].cost;
+    heap[i].cost = edges[e].cost;
+    if(heap[i].cost < before)
+        siftUp(i);
+    else
+        siftDown(i);
+}
+
+void EdgeCollapse::heapRemove(uint32_t e){
+    uint32_t i = heapPos[e];
+    heapPos[e] = NO_ID;
+    HeapEntry last = heap.back();
+    heap.pop_back();
+    if(i < heap.size()){
+        heap[i] = last;
+        heapPos[last.edge] = i;
+        if(i > 0 && last < heap[(i - 1) / 2])
+            siftUp(i);
+        else
+            siftDown(i);
+    }
+}
+
+void EdgeCollapse::siftUp(uint32_t i){
+    HeapEntry entry = heap[i];
+    while(i > 0){
+        uint32_t parent = (i - 1) / 2;
+        if(!(entry < heap[parent]))
+            break;
+        heap[i] = heap[parent];
+        heapPos[heap[i].edge] = i;
+        i = parent;
+    }
+    heap[i] = entry;
+    heapPos[entry.edge] = i;
+}
+
+void EdgeCollapse::siftDown(uint32_t i){
+    HeapEntry entry = heap[i];
+    uint32_t size = (uint32_t)heap.size();
+    while(true){
+        uint32_t child = 2 * i + 1;
+        if(child >= size)
+            break;
+        if(child + 1 < size && heap[child + 1] < heap[child])
+            child++;
+        if(!(heap[child] < entry))
+            break;
+        heap[i] = heap[child];
+        heapPos[heap[i].edge] = i;
+        i = child;
+    }
+    heap[i] = entry;
+    heapPos[entry.edge] = i;
+}
@@ -0,0 +1,100 @@
+#ifndef EDGECOLLAPSE_H
+#define EDGECOLLAPSE_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <stdint.h>
+#include "Quadric.h"
+#include "Adjacency.h"
+
+// Greedy simplification of Garland and Heckbert: the edge whose collapse costs the least error,
+// moving both its vertices to the point of least error of their summed quadrics, is collapsed
+// first, until the mesh is down to a target number of faces. The edges are in a binary heap
+// indexed by edge, with the cost copied into the heap so the heap's own array is all it reads.
+// A collapse evaluates the edges around it again and moves them in the heap. Adding quadrics can
+// only raise the least error, so most of them move down from near the bottom; a cost that went
+// down is kept only for edges whose cost is the best of a few candidate points rather than the
+// least error. Edges that became duplicates of another leave the heap when they die. The faces
+// and edges around every vertex are lists in two arenas, written again at the end when they change.
+//
+// A collapse that would make the mesh non-manifold or turn a face over is skipped until one of
+// the edge's vertices changes. Edges on the border of the mesh add the plane through them
+// perpendicular to their face to both of their vertices, so borders keep their shape.
+
+// Weight of the border planes, relative to the planes of the faces
+#define COLLAPSE_BORDER_WEIGHT 10.0
+// Smallest cosine of the angle a face may turn by in a collapse
+#define COLLAPSE_MIN_COS 0.5f
+
+class EdgeCollapse{
+public:
+    // Start from the whole mesh, with the fundamental quadric of every vertex and the faces around it
+    void init(const std::vector<glm::vec3> &vertices, const std::vector<glm::ivec3> &faces, const VertexFaces &adjacency,
+              const std::vector<Quadric> &quadrics, int numThreads);
+    // Collapse edges until at most targetFaces faces are left or no edge can be collapsed. Later
+    // calls go on from where the last one stopped.
+    void simplify(size_t targetFaces);
+    size_t numFaces() const { return liveFaces; }
+    // The remaining faces in their original order, and the vertices they use in the order of their ids
+    void extract(std::vector<glm::vec3> &lod_vertices, std::vector<glm::ivec3> &lod_faces) const;
+
+private:
+    struct Edge{
+        uint32_t v[2];  // v[0] is kept by the collapse, v[1] removed
+        float cost;
+        glm::vec3 target;
+    };
+
+    // Lists of ids of every vertex, one after the other in data. A list that changes is written
+    // again at the end of data, which is compacted when most of it is stale.
+    struct ListArena{
+        std::vector<uint32_t> data;
+        std::vector<uint32_t> first, count;
+        size_t live = 0;
+
+        const uint32_t *begin(uint32_t v) const { return data.data() + first[v]; }
+        const uint32_t *end(uint32_t v) const { return data.data() + first[v] + count[v]; }
+        void assign(uint32_t v, const std::vector<uint32_t> &ids);
+    };
+
+    void evaluate(uint32_t e);
+    bool canCollapse(uint32_t e);
+    void collapse(uint32_t e);
+    // Whether face f still faces the same way once its vertex v is moved to target
+    bool keepsOrientation(uint32_t f, uint32_t v, const glm::vec3 &target) const;
+
+    // Heap of edges ordered by cost, then id. The cost in the heap can be a rounding above the
+    // cost of the edge.
+    struct HeapEntry{
+        float cost;
+        uint32_t edge;
+        bool operator<(const HeapEntry &other) const{
+            return cost < other.cost || (cost == other.cost && edge < other.edge);
+        }
+    };
+    void heapPush(uint32_t e);
+    void heapPop();
+    // Move edge e to its place for its new cost, or take it out of the heap
+    void heapUpdate(uint32_t e);
+    void heapRemove(uint32_t e);
+    void siftUp(uint32_t i);
+    void siftDown(uint32_t i);
+
+    std::vector<glm::vec3> position;
+    std::vector<Quadric> quadric;
+    std::vector<glm::ivec3> face;
+    std::vector<uint8_t> faceAlive;
+    size_t liveFaces = 0;
+    std::vector<Edge> edges;
+    // Whether the cost of an edge came from the fallback of evaluate
+    std::vector<uint8_t> edgeAlive, edgeFallback;
+    ListArena vertexFaces, vertexEdges;
+    std::vector<HeapEntry> heap;
+    std::vector<uint32_t> heapPos;
+    // Vertices marked with the current stamp, and the lists being rewritten
+    std::vector<uint32_t> mark;
+    uint32_t stamp = 0;
+    std::vector<uint32_t> scratch;
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "LazyPVS.h"
+#include <stdio.h>
+#include <algorithm>
+#include <cstring>
+
+LazyPVS::LazyPVS() : numCells(0), rowWords(0), stopping(false), fileEnd(0){
+}
+
+LazyPVS::~LazyPVS(){
+    close();
+}
+
+bool LazyPVS::open(const char *filename, TileMap &_tilemap, const VisibilitySettings &_settings){
+    close();
+    tilemap = _tilemap;
+    settings = _settings;
+    settings.symmetric = false;
+    settings.regionSize = 0;
+    numCells = tilemap.width * tilemap.height;
+    rowWords = PVS::wordsPerRow(numCells);
+    if(numCells == 0)
+        return false;
+
+    rowState.assign(numCells, ROW_MISSING);
+    fileOffsets.assign(numCells, 0);
+    Visibility::SamplerSettings sampler = Visibility::samplerSettings(settings);
+    if(!readCache(filename, tilemap, Visibility::fileFlags(settings), sampler)){
+        // Start a new cache for this map and these settings
+        file.close();
+        file.clear();
+        file.open(filename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        PVSHeader header = {};
+        header.magic = PVS_CACHE_MAGIC;
+        header.version = PVS_CACHE_VERSION;
+        header.width = tilemap.width;
+        header.height = tilemap.height;
+        header.tilemapHash = tilemap.Hash();
+        header.rowWords = rowWords;
+        header.flags = Visibility::fileFlags(settings);
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)&sampler, sizeof(sampler));
+        file.flush();
+        if(!file){
+            printf("[PVS] Cannot write the cache '%s', rows will be kept in memory only\n", filename);
+            file.close();
+        }
+        fileEnd = sizeof(header) + sizeof(sampler);
+        std::fill(fileOffsets.begin(), fileOffsets.end(), 0);
+    }
+
+    int numComputed = 0;
+    for(uint32_t cell = 0; cell < numCells; cell++){
+        if(fileOffsets[cell] != 0){
+            rowState[cell] = ROW_DONE;
+            numComputed++;
+        }
+    }
+    printf("[PVS] Computing cell visibility on demand, %d of %d cells cached in '%s'\n", numComputed, numCells, filename);
+
+    tracer.reset(new RayPacketTracer(tilemap, settings.simd));
+    stopping = false;
+    int numThreads = std::max(1, settings.numThreads - 1);
+    for(int i = 0; i < numThreads; i++){
+        workers.emplace_back(&LazyPVS::work, this);
+    }
+    return true;
+}
+
+// Index the records of an existing cache file, false if it was made for another map or settings
+
+bool LazyPVS::readCache(const char *filename, TileMap &tilemap, uint32_t flags, const Visibility::SamplerSettings &sampler){
+    file.open(filename, std::ios::in | std::ios::out | std::ios::binary);
+    if(!file)
+        return false;
+    PVSHeader header;
+    if(!file.read((char *)&header, sizeof(header)))
+        return false;
+    if(header.magic != PVS_CACHE_MAGIC || header.version != PVS_CACHE_VERSION ||
+       header.width != (uint32_t)tilemap.width || header.height != (uint32_t)tilemap.height ||
+       header.tilemapHash != tilemap.Hash() || header.rowWords != rowWords || header.flags != flags)
+        return false;
+    Visibility::SamplerSettings fileSampler;
+    if(!file.read((char *)&fileSampler, sizeof(fileSampler)) || memcmp(&fileSampler, &sampler, sizeof(sampler)) != 0){
+        printf("[PVS] The cache '%s' was computed with other ray counts, starting over\n", filename);
+        return false;
+    }
+
+    file.seekg(0, std::ios::end);
+    uint64_t fileSize = file.tellg();
+    uint64_t recordSize = sizeof(uint64_t) * (1 + rowWords);
+    fileEnd = sizeof(header) + sizeof(sampler);
+    while(fileEnd + recordSize <= fileSize){
+        uint64_t cell;
+        file.seekg(fileEnd);
+        if(!file.read((char *)&cell, sizeof(cell)) || cell >= numCells)
+            break;
+        fileOffsets[cell] = fileEnd + sizeof(cell);
+        fileEnd += recordSize;
+    }
+    file.clear();
+    return true;
+}
+
+void LazyPVS::close(){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    requested.notify_all();
+    for(std::thread &worker : workers){
+        worker.join();
+    }
+    workers.clear();
+    tracer.reset();
+    file.close();
+    file.clear();
+    queue.clear();
+    lru.clear();
+    cachedRows.clear();
+}
+
+void LazyPVS::request(uint32_t cell, bool urgent){
+    std::lock_guard<std::mutex> guard(lock);
+    if(cell >= numCells || rowState[cell] == ROW_DONE || rowState[cell] == ROW_COMPUTING)
+        return;
+    if(rowState[cell] == ROW_QUEUED){
+        if(!urgent)
+            return;
+        queue.erase(std::find(queue.begin(), queue.end(), cell));
+    }
+    if(urgent)
+        queue.push_front(cell);
+    else
+        queue.push_back(cell);
+    rowState[cell] = ROW_QUEUED;
+    requested.notify_one();
+}
+
+bool LazyPVS::getRow(uint32_t cell, std::vector<uint64_t> &row){
+    std::lock_guard<std::mutex> guard(lock);
+    if(cell >= numCells || rowState[cell] != ROW_DONE)
+        return false;
+
+    auto cached = cachedRows.find(cell);
+    if(cached != cachedRows.end()){
+        lru.splice(lru.end(), lru, cached->second.lruPos);
+        row = cached->second.bits;
+        return true;
+    }
+
+    // Evicted from memory, but in the file
+    row.resize(rowWords);
+    file.clear();
+    file.seekg(fileOffsets[cell]);
+    if(!file.read((char *)row.data(), sizeof(uint64_t) * rowWords)){
+        fileOffsets[cell] = 0;
+        rowState[cell] = ROW_MISSING;
+        return false;
+    }
+    cacheRow(cell, row);
+    return true;
+}
+
+void LazyPVS::work(){
+    std::vector<uint64_t> row(rowWords);
+    std::unique_lock<std::mutex> guard(lock);
+    while(true){
+        requested.wait(guard, [&](){ return stopping || !queue.empty(); });
+        if(stopping)
+            break;
+        uint32_t cell = queue.front();
+        queue.pop_front();
+        rowState[cell] = ROW_COMPUTING;
+
+        guard.unlock();
+        visibility.computeCellRow(cell, tilemap, settings, *tracer, row.data());
+        guard.lock();
+
+        storeRow(cell, row);
+        rowState[cell] = ROW_DONE;
+    }
+}
+
+void LazyPVS::storeRow(uint32_t cell, const std::vector<uint64_t> &row){
+    if(file.is_open()){
+        uint64_t index = cell;
+        file.clear();
+        file.seekp(fileEnd);
+        file.write((const char *)&index, sizeof(index));
+        file.write((const char *)row.data(), sizeof(uint64_t) * rowWords);
+        file.flush();
+        if(file){
+            fileOffsets[cell] = fileEnd + sizeof(index);
+            fileEnd += sizeof(index) + sizeof(uint64_t) * rowWords;
+        }
+    }
+    cacheRow(cell, row);
+}
+
+void LazyPVS::cacheRow(uint32_t cell, const std::vector<uint64_t> &row){
+    auto cached = cachedRows.find(cell);
+    if(cached != cachedRows.end()){
+        cached->second.bits = row;
+        lru.splice(lru.end(), lru, cached->second.lruPos);
+        return;
+    }
+    lru.push_back(cell);
+    cachedRows[cell] = CachedRow{row, std::prev(lru.end())};
+
+    while(cachedRows.size() > (size_t)std::max(1, settings.cachedRows)){
+        uint32_t oldest = lru.front();
+        lru.pop_front();
+        cachedRows.erase(oldest);
+        // Rows that could not be written have to be computed again
+        if(fileOffsets[oldest] == 0)
+            rowState[oldest] = ROW_MISSING;
+    }
+}
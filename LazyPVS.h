@@ -0,0 +1,93 @@
+#ifndef LAZY_PVS_H
+#define LAZY_PVS_H
+
+#include <stdint.h>
+#include <fstream>
+#include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "TileMap.h"
+#include "PVS.h"
+#include "Visibility.h"
+
+#define PVS_CACHE_MAGIC 0x43535650 // "PVSC"
+#define PVS_CACHE_VERSION 2
+
+// Computes the PVS row of a cell on background threads the first time it is requested, instead
+// of every row before the first frame. Finished rows are appended to a cache file, so the next
+// run on the same map with the same settings finds them, and the most recently used rows are
+// kept in memory:
+//   PVSHeader (numRows unused)
+//   Visibility::SamplerSettings, so rows traced with other ray counts are not reused
+//   records of a 64-bit cell index (x * height + y), then rowWords 64-bit words of the row
+// A record cut short when the program was killed is overwritten by the next one.
+
+class LazyPVS{
+public:
+    LazyPVS();
+    ~LazyPVS();
+    LazyPVS(const LazyPVS &) = delete;
+    LazyPVS &operator=(const LazyPVS &) = delete;
+
+    // Rows are computed per cell, over the whole circle and in one piece (symmetric, regionSize,
+    // sectors and maxDistance are ignored), on settings.numThreads - 1 threads so the render
+    // thread keeps a core
+    bool open(const char *filename, TileMap &tilemap, const VisibilitySettings &settings);
+    void close();
+    bool isOpen() const { return !workers.empty(); }
+
+    // Queue the cell if its row is not computed yet. Urgent requests jump the queue.
+    void request(uint32_t cell, bool urgent);
+    // Copy the row of the cell if it has been computed
+    bool getRow(uint32_t cell, std::vector<uint64_t> &row);
+
+    uint32_t getNumCells() const { return numCells; }
+    uint32_t getRowWords() const { return rowWords; }
+
+private:
+    enum RowState : uint8_t {
+        ROW_MISSING,
+        ROW_QUEUED,
+        ROW_COMPUTING,
+        ROW_DONE
+    };
+    struct CachedRow{
+        std::vector<uint64_t> bits;
+        std::list<uint32_t>::iterator lruPos;
+    };
+
+    bool readCache(const char *filename, TileMap &tilemap, uint32_t flags, const Visibility::SamplerSettings &sampler);
+    void work();
+    // The ones below are called with lock held
+    void storeRow(uint32_t cell, const std::vector<uint64_t> &row);
+    void cacheRow(uint32_t cell, const std::vector<uint64_t> &row);
+
+    TileMap tilemap;
+    VisibilitySettings settings;
+    Visibility visibility;
+    std::unique_ptr<RayPacketTracer> tracer;
+    uint32_t numCells, rowWords;
+
+    std::mutex lock;
+    std::condition_variable requested;
+    bool stopping;
+    std::vector<std::thread> workers;
+    std::deque<uint32_t> queue;
+    std::vector<RowState> rowState;
+
+    std::fstream file;
+    uint64_t fileEnd;
+    // Offset of the bits of every row in the file, 0 if it is not there
+    std::vector<uint64_t> fileOffsets;
+
+    // Least recently used first
+    std::list<uint32_t> lru;
+    std::unordered_map<uint32_t, CachedRow> cachedRows;
+};
+
+#endif
@@ -1,92 +1,430 @@
 #include "Octree.h"
 #include <stdio.h>
-#include <eigen3/Eigen/Dense>
+#include <algorithm>
+#include <array>
+#include <limits>
 
 int current_node_id = 0;
 int QEM_nodes = 0;
 
-bool insideBBox(glm::vec3 *bbox, glm::vec3 point){
-    bool inside = true;
-    for(int i=0;i<3;i++){
-        inside = inside && (bbox[0][i] <= point[i]) && (bbox[1][i] > point[i]);
+// Spread the 10 low bits of v to every third bit
+static uint32_t spreadBits(uint32_t v){
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+void LinearOctree::build(const std::vector<glm::vec3> &vertices, int numThreads){
+    numThreads = std::max(numThreads, 1);
+    const int cellsPerAxis = 1 << (OCTREE_MAX_DEPTH - 1);
+    size_t n = vertices.size();
+    keys.resize(n);
+    sortedIds.resize(n);
+    scratchKeys.resize(n);
+    scratchIds.resize(n);
+    parallelFor(numThreads, numThreads, [&](int chunk){
+        for(size_t i = n * chunk / numThreads; i < n * (chunk + 1) / numThreads; i++){
+            uint32_t key = 0;
+            for(int j = 0; j < 3; j++){
+                // Scaling by a power of two is exact, so the cells split where the bounding boxes
+                // of the nodes would
+                float cell = glm::clamp(vertices[i][j] * cellsPerAxis, 0.0f, (float)(cellsPerAxis - 1));
+                key |= spreadBits((uint32_t)cell) << j;
+            }
+            keys[i] = key;
+            sortedIds[i] = (int)i;
+        }
+    });
+
+    // Split the large nodes breadth first with all threads, the others become tasks
+    octreeNodes.clear();
+    octreeNodes.push_back(OctreeNode{0, (uint32_t)n, 0, 0, 1});
+    std::vector<std::pair<uint32_t, bool>> level = {{0, false}}, tasks;
+    size_t taskSize = std::max(n / OCTREE_TASKS, (size_t)1);
+    while(!level.empty()){
+        std::vector<std::pair<uint32_t, bool>> nextLevel;
+        for(auto [node, inScratch] : level){
+            OctreeNode parent = octreeNodes[node];
+            if(parent.end - parent.begin <= taskSize || parent.depth == OCTREE_MAX_DEPTH){
+                tasks.push_back({node, inScratch});
+                continue;
+            }
+            uint32_t childStart[9];
+            int numChildren = partition(parent, inScratch, childStart, numThreads);
+            octreeNodes[node].firstChild = (uint32_t)octreeNodes.size();
+            octreeNodes[node].numChildren = (uint8_t)numChildren;
+            for(int c = 0; c < 8; c++){
+                if(childStart[c + 1] != childStart[c]){
+                    nextLevel.push_back({(uint32_t)octreeNodes.size(), (numChildren > 1) != inScratch});
+                    octreeNodes.push_back(OctreeNode{parent.begin + childStart[c], parent.begin + childStart[c + 1], 0, 0, (uint8_t)(parent.depth + 1)});
+                }
+            }
+        }
+        level.swap(nextLevel);
     }
-    return inside;
+
+    // Build the subtrees, largest first, each in its own arena with the task's node at 0
+    std::vector<std::vector<OctreeNode>> arenas(tasks.size());
+    std::vector<int> taskOrder(tasks.size());
+    for(size_t t = 0; t < tasks.size(); t++){
+        taskOrder[t] = (int)t;
+    }
+    auto taskVertices = [&](int t){
+        return octreeNodes[tasks[t].first].end - octreeNodes[tasks[t].first].begin;
+    };
+    std::stable_sort(taskOrder.begin(), taskOrder.end(), [&](int a, int b){
+        return taskVertices(a) > taskVertices(b);
+    });
+    parallelFor(numThreads, (int)tasks.size(), [&](int job){
+        int t = taskOrder[job];
+        arenas[t].push_back(octreeNodes[tasks[t].first]);
+        split(arenas[t], 0, tasks[t].second);
+    });
+
+    // Arena index i > 0 goes to base + i - 1
+    std::vector<uint32_t> bases(tasks.size());
+    size_t numNodes = octreeNodes.size();
+    for(size_t t = 0; t < tasks.size(); t++){
+        bases[t] = (uint32_t)numNodes;
+        numNodes += arenas[t].size() - 1;
+    }
+    octreeNodes.resize(numNodes);
+    parallelFor(numThreads, (int)tasks.size(), [&](int t){
+        for(auto &node : arenas[t]){
+            if(node.numChildren > 0)
+                node.firstChild += bases[t] - 1;
+        }
+        octreeNodes[tasks[t].first] = arenas[t][0];
+        std::copy(arenas[t].begin() + 1, arenas[t].end(), octreeNodes.begin() + bases[t]);
+        std::vector<OctreeNode>().swap(arenas[t]);
+    });
+
+    // Only needed while building
+    std::vector<uint32_t>().swap(keys);
+    std::vector<uint32_t>().swap(scratchKeys);
+    std::vector<int>().swap(scratchIds);
 }
 
-void processNode(OctreeNode* currentNode, std::vector<glm::vec3>* vertices, int crt_depth, int max_depth){
-    // No vertices inside node so no reason to split
-    if(currentNode->verts_id.size() == 0){
-        currentNode->isLeaf = true;
+// The keys and ids of a node are in the scratch arrays if inScratch, and its children are
+// scattered into the other pair, so every vertex is moved once per level. A single child keeps
+// the range where it is. The leaves finish in sortedIds.
+
+int LinearOctree::partition(const OctreeNode &node, bool inScratch, uint32_t childStart[9], int numThreads){
+    const uint32_t *srcKeys = inScratch ? scratchKeys.data() : keys.data();
+    const int *srcIds = inScratch ? scratchIds.data() : sortedIds.data();
+    uint32_t *dstKeys = inScratch ? keys.data() : scratchKeys.data();
+    int *dstIds = inScratch ? sortedIds.data() : scratchIds.data();
+    int shift = 3 * (OCTREE_MAX_DEPTH - 1 - node.depth);
+
+    // Count and scatter in contiguous chunks, each chunk writing after the ones before it in
+    // every child, so the order is kept whatever the number of chunks
+    uint32_t size = node.end - node.begin;
+    int numChunks = (int)glm::clamp(size / 65536u, 1u, (uint32_t)std::max(numThreads, 1));
+    std::array<uint32_t, 8> oneChunk;
+    std::vector<std::array<uint32_t, 8>> chunks(numChunks > 1 ? numChunks : 0);
+    std::array<uint32_t, 8> *counts = (numChunks > 1) ? chunks.data() : &oneChunk;
+    auto chunkBegin = [&](int chunk){
+        return node.begin + (uint32_t)((uint64_t)size * chunk / numChunks);
+    };
+    auto countChunk = [&](int chunk){
+        counts[chunk].fill(0);
+        for(uint32_t i = chunkBegin(chunk), end = chunkBegin(chunk + 1); i < end; i++){
+            counts[chunk][(srcKeys[i] >> shift) & 7]++;
+        }
+    };
+    auto scatterChunk = [&](int chunk){
+        std::array<uint32_t, 8> &next = counts[chunk];
+        for(uint32_t i = chunkBegin(chunk), end = chunkBegin(chunk + 1); i < end; i++){
+            uint32_t dst = next[(srcKeys[i] >> shift) & 7]++;
+            dstKeys[dst] = srcKeys[i];
+            dstIds[dst] = srcIds[i];
+        }
+    };
+    // Most nodes are small, keep the threads out of their way
+    if(numChunks > 1)
+        parallelFor(numChunks, numChunks, countChunk);
+    else
+        countChunk(0);
+    int numChildren = 0;
+    childStart[0] = 0;
+    for(int c = 0; c < 8; c++){
+        uint32_t childSize = 0;
+        for(int chunk = 0; chunk < numChunks; chunk++){
+            uint32_t chunkCount = counts[chunk][c];
+            counts[chunk][c] = node.begin + childStart[c] + childSize;
+            childSize += chunkCount;
+        }
+        childStart[c + 1] = childStart[c] + childSize;
+        numChildren += childSize != 0;
+    }
+    if(numChildren > 1 && numChunks > 1)
+        parallelFor(numChunks, numChunks, scatterChunk);
+    else if(numChildren > 1)
+        scatterChunk(0);
+    return numChildren;
+}
+
+void LinearOctree::split(std::vector<OctreeNode> &arena, uint32_t node, bool inScratch){
+    OctreeNode parent = arena[node];
+    if(parent.end - parent.begin <= 1 || parent.depth == OCTREE_MAX_DEPTH){
+        if(inScratch)
+            std::copy(scratchIds.begin() + parent.begin, scratchIds.begin() + parent.end, sortedIds.begin() + parent.begin);
         return;
     }
-    
-    glm::vec3 halfsize = (currentNode->bbox[1] - currentNode->bbox[0]) * 0.5f;
-
-    for (int i=0;i<8;i++){
-        currentNode->children[i] = new OctreeNode();
-        // Define node's BBox
-        currentNode->children[i]->bbox[0][0] = currentNode->bbox[0][0] + ((i & 0b001)!=0) * halfsize[0];
-        currentNode->children[i]->bbox[0][1] = currentNode->bbox[0][1] + ((i & 0b010)!=0) * halfsize[1];
-        currentNode->children[i]->bbox[0][2] = currentNode->bbox[0][2] + ((i & 0b100)!=0) * halfsize[2];
-        currentNode->children[i]->bbox[1] = currentNode->children[i]->bbox[0] + halfsize;
-        // See which of the vertices go into the newly created node
-        for(auto v : currentNode->verts_id){
-            if(insideBBox(currentNode->children[i]->bbox, vertices->at(v))){
-                currentNode->children[i]->verts_id.push_back(v);
+
+    uint32_t childStart[9];
+    int numChildren = partition(parent, inScratch, childStart, 1);
+    uint32_t firstChild = (uint32_t)arena.size();
+    for(int c = 0; c < 8; c++){
+        if(childStart[c + 1] != childStart[c]){
+            arena.push_back(OctreeNode{parent.begin + childStart[c], parent.begin + childStart[c + 1], 0, 0, (uint8_t)(parent.depth + 1)});
+        }
+    }
+    arena[node].firstChild = firstChild;
+    arena[node].numChildren = (uint8_t)numChildren;
+    for(int c = 0; c < numChildren; c++){
+        split(arena, firstChild + c, (numChildren > 1) != inScratch);
+    }
+}
+
+void sumNodeQuadrics(const LinearOctree &octree, const std::vector<glm::vec3> &vertices,
+                     const std::vector<Quadric> &error_metrics, NodeQuadrics &sums){
+    const std::vector<int> &ids = octree.vertexIds();
+    const std::vector<OctreeNode> &nodes = octree.nodes();
+    sums.quadrics.assign(nodes.size(), Quadric());
+    sums.positions.assign(nodes.size(), glm::vec3(0.0f));
+    for(size_t n = nodes.size(); n-- > 0;){
+        const OctreeNode &node = nodes[n];
+        Quadric &quadric = sums.quadrics[n];
+        glm::vec3 &position = sums.positions[n];
+        if(node.numChildren > 0){
+            for(uint32_t c = node.firstChild; c < node.firstChild + node.numChildren; c++){
+                quadric += sums.quadrics[c];
+                position += sums.positions[c];
             }
         }
-        if(crt_depth < max_depth){
-            currentNode->children[i]->isLeaf = false;
-            processNode(currentNode->children[i], vertices, crt_depth+1, max_depth);
+        else{
+            for(uint32_t i = node.begin; i < node.end; i++){
+                quadric += error_metrics[ids[i]];
+                position += vertices[ids[i]];
+            }
         }
-        else
-            currentNode->children[i]->isLeaf=true;
     }
 }
 
-void buildVertexLUT(OctreeNode* node, std::unordered_map<int, int>* lut, std::vector<glm::vec3>* octree_vertices, 
-                    int crt_depth, int max_depth, std::vector<glm::vec3>* vertices,
-                    std::vector<Eigen::Matrix4f>* error_metrics){
-    if(node->verts_id.size() == 0){
+// Fields of a cluster to solve
+enum ClusterField{
+    A00, A01, A02, A11, A12, A22,  // upper 3x3 of the quadric
+    B0, B1, B2,                    // its last column
+    CX, CY, CZ,                    // centroid, replaced by the representative
+    LX, LY, LZ, CELL_SIZE,         // lower corner and side of the node's cell
+    QX, QY, QZ,                    // point of least error, clamped to the cell
+    SOLVED,                        // 1 if the representative comes from the quadric
+    NUM_CLUSTER_FIELDS
+};
+
+// Clusters are solved CLUSTER_LANES at a time, with every field in its own array like the lanes
+// of a SIMD register
+#define CLUSTER_LANES 8
+struct ClusterBlock{
+    QuadricReal field[NUM_CLUSTER_FIELDS][CLUSTER_LANES];
+};
+
+// Find the point of least quadric error of every cluster of the block: the solution of A x = -b,
+// with A the 3x3 part of the quadric and b its last column. It is solved around the centroid with
+// an LDL^T decomposition, and kept in the cell. Systems whose determinant is small next to the cube
+// of the mean eigenvalue (the trace / 3) are flat or straight patches where the solution runs off
+// along the surface, and keep the centroid. There are no branches or selects feeding arithmetic,
+// so that both loops are vectorised.
+
+static void solveClusters(ClusterBlock &block){
+    QuadricReal (&f)[NUM_CLUSTER_FIELDS][CLUSTER_LANES] = block.field;
+    // Inverse of a pivot without a test, which would keep the compiler from vectorising: the
+    // pivots of singular systems give large values, and their results are thrown away
+    const QuadricReal tiny = std::numeric_limits<QuadricReal>::min();
+    auto inversePivot = [tiny](QuadricReal d){
+        return 1 / (std::abs(d) + tiny);
+    };
+    for(int i = 0; i < CLUSTER_LANES; i++){
+        QuadricReal a00 = f[A00][i], a01 = f[A01][i], a02 = f[A02][i];
+        QuadricReal a11 = f[A11][i], a12 = f[A12][i], a22 = f[A22][i];
+        QuadricReal cx = f[CX][i], cy = f[CY][i], cz = f[CZ][i];
+
+        QuadricReal d0 = a00;
+        QuadricReal i0 = inversePivot(d0);
+        QuadricReal l10 = a01 * i0, l20 = a02 * i0;
+        QuadricReal d1 = a11 - l10 * a01;
+        QuadricReal i1 = inversePivot(d1);
+        QuadricReal l21 = (a12 - l20 * a01) * i1;
+        QuadricReal d2 = a22 - l20 * a02 - l21 * l21 * d1;
+        QuadricReal i2 = inversePivot(d2);
+        QuadricReal meanEigen = (a00 + a11 + a22) / 3;
+        bool wellConditioned = (std::min(d0, std::min(d1, d2)) > 0) &
+                               (d0 * d1 * d2 > (QuadricReal)QEM_MIN_CONDITION * meanEigen * meanEigen * meanEigen);
+
+        // Residual at the centroid, -(A c + b)
+        QuadricReal r0 = -(a00 * cx + a01 * cy + a02 * cz + f[B0][i]);
+        QuadricReal r1 = -(a01 * cx + a11 * cy + a12 * cz + f[B1][i]);
+        QuadricReal r2 = -(a02 * cx + a12 * cy + a22 * cz + f[B2][i]);
+        QuadricReal y1 = r1 - l10 * r0;
+        QuadricReal y2 = r2 - l20 * r0 - l21 * y1;
+        QuadricReal z2 = y2 * i2;
+        QuadricReal z1 = y1 * i1 - l21 * z2;
+        QuadricReal z0 = r0 * i0 - l10 * z1 - l20 * z2;
+
+        // A solution out of the cell is pulled back towards the centroid until it is on the cell's
+        // border. The error is convex, so this point is never worse than the centroid, unlike
+        // clamping every axis.
+        QuadricReal size = f[CELL_SIZE][i], lx = f[LX][i], ly = f[LY][i], lz = f[LZ][i];
+        // Of the steps to the lower and upper faces along an axis, the positive one is the limit
+        auto maxStep = [](QuadricReal lower, QuadricReal upper, QuadricReal centroid, QuadricReal offset){
+            return std::max((upper - centroid) / offset, (lower - centroid) / offset);
+        };
+        QuadricReal t = std::min(std::min((QuadricReal)1, maxStep(lx, lx + size, cx, z0)),
+                                 std::min(maxStep(ly, ly + size, cy, z1), maxStep(lz, lz + size, cz, z2)));
+        // NaNs and infinities of singular systems end up on the cell's faces
+        f[QX][i] = std::min(lx + size, std::max(lx, cx + t * z0));
+        f[QY][i] = std::min(ly + size, std::max(ly, cy + t * z1));
+        f[QZ][i] = std::min(lz + size, std::max(lz, cz + t * z2));
+        f[SOLVED][i] = wellConditioned ? (QuadricReal)1 : (QuadricReal)0;
+    }
+    for(int i = 0; i < CLUSTER_LANES; i++){
+        QuadricReal w = f[SOLVED][i];
+        f[CX][i] = w * f[QX][i] + (1 - w) * f[CX][i];
+        f[CY][i] = w * f[QY][i] + (1 - w) * f[CY][i];
+        f[CZ][i] = w * f[QZ][i] + (1 - w) * f[CZ][i];
+    }
+}
+
+// Faces whose deepest node is found by one job of OctreeCut
+#define CUT_CHUNK (1 << 16)
+
+OctreeCut::OctreeCut(const LinearOctree &octree, const NodeQuadrics &sums, const std::vector<glm::vec3> &vertices,
+                     const std::vector<glm::ivec3> &faces, int numThreads)
+    : octree(octree), sums(sums), vertices(vertices){
+    const std::vector<int> &ids = octree.vertexIds();
+    const std::vector<OctreeNode> &nodes = octree.nodes();
+    size_t numNodes = nodes.size();
+    representative.resize(numNodes);
+    solved.assign(numNodes, 0);
+    isSplit.assign(numNodes, 0);
+    if(numNodes == 0)
         return;
+
+    std::vector<uint32_t> parent(numNodes, 0), leaf(vertices.size());
+    for(uint32_t n = 0; n < numNodes; n++){
+        for(int c = 0; c < nodes[n].numChildren; c++){
+            parent[nodes[n].firstChild + c] = n;
+        }
+        if(nodes[n].numChildren == 0){
+            for(uint32_t i = nodes[n].begin; i < nodes[n].end; i++){
+                leaf[ids[i]] = n;
+            }
+        }
     }
-    if(crt_depth < max_depth){
-        if(node->isLeaf){
-            printf("[ERR] Cannot go deeper into the octree! Reached leaf at %i, requested depth %i\n", crt_depth, max_depth);
-            return;
-        }
-        for (int i=0;i<8;i++){
-            buildVertexLUT(node->children[i], lut, octree_vertices, crt_depth+1, max_depth, vertices, error_metrics);
-        }
-    }
-    else if(crt_depth == max_depth){
-        
-        // Here we compute the QEM to determine the representative
-        Eigen::Matrix4f Qbar;
-        Qbar << 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f;
-        glm::vec3 center(0.0f, 0.0f, 0.0f);
-        for(auto v : node->verts_id){
-            Qbar += error_metrics->at(v);
-            center += vertices->at(v);
-        }
-        center /= node->verts_id.size();
-        Qbar(3, 0) = 0.0f; Qbar(3, 1) = 0.0f; Qbar(3, 2) = 0.0f; Qbar(3, 3) = 1.0f; 
-        Eigen::Vector4f best_pos;
-        if(glm::abs(Qbar.determinant()) > 1e-3){ //glm::abs(Qbar.determinant()) > 1e-3
-            best_pos = Qbar.colPivHouseholderQr().solve(Eigen::Vector4f(0.0f, 0.0f, 0.0f, 1.0f));
-            octree_vertices->push_back(glm::vec3(best_pos(0), best_pos(1), best_pos(2)));
-            QEM_nodes+=1;
+    // The deepest node holding both a and b
+    auto common = [&](uint32_t a, uint32_t b){
+        while(nodes[a].depth > nodes[b].depth) a = parent[a];
+        while(nodes[b].depth > nodes[a].depth) b = parent[b];
+        while(a != b){
+            a = parent[a];
+            b = parent[b];
         }
-        else{
-            octree_vertices->push_back(center);
+        return a;
+    };
+    size_t numFaces = faces.size();
+    std::vector<uint32_t> faceNode(numFaces);
+    int numChunks = (int)((numFaces + CUT_CHUNK - 1) / CUT_CHUNK);
+    parallelFor(numThreads, numChunks, [&](int chunk){
+        size_t end = std::min((size_t)(chunk + 1) * CUT_CHUNK, numFaces);
+        for(size_t f = (size_t)chunk * CUT_CHUNK; f < end; f++){
+            uint32_t l0 = leaf[faces[f][0]], l1 = leaf[faces[f][1]], l2 = leaf[faces[f][2]];
+            uint32_t n01 = common(l0, l1), n12 = common(l1, l2), n02 = common(l0, l2);
+            uint32_t n = (nodes[n01].depth > nodes[n12].depth) ? n01 : n12;
+            faceNode[f] = (nodes[n02].depth > nodes[n].depth) ? n02 : n;
         }
+    });
+    // Faces with two vertices in one leaf are never left, leaves are not split
+    nodeFaces.assign(numNodes, 0);
+    for(size_t f = 0; f < numFaces; f++){
+        nodeFaces[faceNode[f]]++;
+    }
 
-        // octree_vertices->push_back(center);
+    uint32_t root = 0;
+    solve(&root, 1);
+}
+
+void OctreeCut::refine(size_t targetFaces){
+    const std::vector<OctreeNode> &nodes = octree.nodes();
+    uint32_t children[8];
+    while(liveFaces < targetFaces && !queue.empty()){
+        uint32_t n = queue.top().second;
+        queue.pop();
+        isSplit[n] = 1;
+        liveFaces += nodeFaces[n];
+        for(int c = 0; c < nodes[n].numChildren; c++){
+            children[c] = nodes[n].firstChild + c;
+        }
+        solve(children, nodes[n].numChildren);
+    }
+}
 
-        for(auto v : node->verts_id){
-            (*lut)[v] = current_node_id;
+void OctreeCut::solve(const uint32_t *nodeIds, int count){
+    const std::vector<int> &ids = octree.vertexIds();
+    const std::vector<OctreeNode> &nodes = octree.nodes();
+    ClusterBlock block;
+    for(int i = 0; i < CLUSTER_LANES; i++){
+        // Spare lanes repeat the last node
+        uint32_t n = nodeIds[std::min(i, count - 1)];
+        const OctreeNode &node = nodes[n];
+        const QuadricReal *q = sums.quadrics[n].q;
+        glm::vec3 center = sums.positions[n] / (float)(node.end - node.begin);
+        // The cell of the node, found from any of its vertices
+        float cellsPerAxis = (float)(1 << (node.depth - 1));
+        glm::vec3 corner = glm::floor(glm::clamp(vertices[ids[node.begin]] * cellsPerAxis, 0.0f, cellsPerAxis - 1)) / cellsPerAxis;
+        QuadricReal values[NUM_CLUSTER_FIELDS] = {q[0], q[1], q[2], q[4], q[5], q[7], q[3], q[6], q[8],
+                                                  center.x, center.y, center.z, corner.x, corner.y, corner.z, 1 / cellsPerAxis};
+        for(int f = 0; f < NUM_CLUSTER_FIELDS; f++){
+            block.field[f][i] = values[f];
         }
-        current_node_id += 1;
+    }
+    solveClusters(block);
+    for(int i = 0; i < count; i++){
+        uint32_t n = nodeIds[i];
+        representative[n] = glm::vec3(block.field[CX][i], block.field[CY][i], block.field[CZ][i]);
+        solved[n] = block.field[SOLVED][i] != 0;
+        if(nodes[n].numChildren > 0)
+            queue.push(std::make_pair(sums.quadrics[n].error(representative[n]), n));
     }
 }
 
+void OctreeCut::extract(std::vector<uint32_t>* lut, std::vector<glm::vec3>* octree_vertices) const{
+    const std::vector<int> &ids = octree.vertexIds();
+    const std::vector<OctreeNode> &nodes = octree.nodes();
+    lut->resize(vertices.size());
+    octree_vertices->clear();
+    current_node_id = 0;
+    QEM_nodes = 0;
+    std::vector<uint32_t> stack;
+    if(!ids.empty())
+        stack.push_back(0);
+    while(!stack.empty()){
+        uint32_t n = stack.back();
+        const OctreeNode &node = nodes[n];
+        stack.pop_back();
+        if(isSplit[n]){
+            for(int c = node.numChildren - 1; c >= 0; c--){
+                stack.push_back(node.firstChild + c);
+            }
+            continue;
+        }
+        for(uint32_t i = node.begin; i < node.end; i++){
+            (*lut)[ids[i]] = (uint32_t)current_node_id;
+        }
+        octree_vertices->push_back(representative[n]);
+        QEM_nodes += solved[n];
+        current_node_id++;
+    }
+}
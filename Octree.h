@@ -3,27 +3,112 @@
 
 #include <vector>
 #include <glm/glm.hpp>
-#include <unordered_map>
 #include <utility>
-#include <eigen3/Eigen/Dense>
+#include <queue>
+#include <stdint.h>
 #include <iostream>
+#include "Quadric.h"
+#include "Parallel.h"
 
-struct OctreeNode {
-    OctreeNode * children[8] = {nullptr};
-    std::vector<int> verts_id;
-    glm::vec3 bbox[2];
-    bool isLeaf;
+// Depth of the smallest nodes, the root (the unit cube) is depth 1
+#define OCTREE_MAX_DEPTH 11
+
+// A node covers the range [begin, end) of LinearOctree::vertexIds(). Its children are stored
+// one after the other from firstChild, only the non-empty ones, in the order of the child index
+// x | y << 1 | z << 2, and always after their parent.
+struct OctreeNode{
+    uint32_t begin, end;
+    uint32_t firstChild;
+    uint8_t numChildren;  // 0 for leaves
+    uint8_t depth;
+};
+
+// Linear octree over vertices in the unit cube. Every vertex gets a 30-bit Morton key, the
+// 10-bit cell coordinates interleaved x, y, z from the lowest bit, so the octant of a vertex in a
+// node at depth d is the 3 bits of its key below the top 3 * (d - 1), and each node is a
+// contiguous range of one array of vertex ids. A node is split by reading those bits once per
+// vertex and scattering the ids into the ranges of its children, keeping their order, so the
+// ids within every leaf are ascending. Nodes with a single vertex are not split further.
+
+// Built on numThreads threads: the nodes of more than 1 / OCTREE_TASKS of the vertices are split
+// by all threads together, and the subtrees below them are tasks built on their own node arena,
+// one task per thread at a time. The arenas are appended in the order of the tasks, so the nodes
+// are the same for any number of threads.
+#define OCTREE_TASKS 256
+
+class LinearOctree{
+public:
+    void build(const std::vector<glm::vec3> &vertices, int numThreads);
+
+    const std::vector<int> &vertexIds() const { return sortedIds; }
+    // The root is nodes()[0], at depth 1
+    const std::vector<OctreeNode> &nodes() const { return octreeNodes; }
+
+private:
+    // Scatter the vertices of the node into the ranges of its children, childStart[c] to
+    // childStart[c + 1] from node.begin, and return the number of children
+    int partition(const OctreeNode &node, bool inScratch, uint32_t childStart[9], int numThreads);
+    // Split the node arena[node] and below, the child links are indices into arena
+    void split(std::vector<OctreeNode> &arena, uint32_t node, bool inScratch);
+
+    std::vector<uint32_t> keys;
+    std::vector<int> sortedIds;
+    std::vector<OctreeNode> octreeNodes;
+    // Every other level of the split is scattered here
+    std::vector<uint32_t> scratchKeys;
+    std::vector<int> scratchIds;
+};
+
+// Sums over the vertices of every node, indexed like LinearOctree::nodes()
+struct NodeQuadrics{
+    std::vector<Quadric> quadrics;
+    std::vector<glm::vec3> positions;
 };
 
 extern int current_node_id;
 extern int QEM_nodes;
 
-bool insideBBox(glm::vec3* bbox, glm::vec3 point);
+// Sum the quadrics and positions of the vertices of every node in one pass, children before parents
+void sumNodeQuadrics(const LinearOctree &octree, const std::vector<glm::vec3> &vertices,
+                     const std::vector<Quadric> &error_metrics, NodeQuadrics &sums);
 
-void processNode(OctreeNode* node, std::vector<glm::vec3>* vertices, int crt_depth, int max_depth);
+// A cut through the octree: nodes that together hold every vertex once, each one a cluster of the
+// simplified mesh. It starts at the root and is refined by splitting the node of largest error
+// (of its quadric at its representative) into its children, so the detail goes where the
+// clusters lose the most of the surface. A cut is refined to one LOD after the other, from the
+// coarsest.
+//
+// Two vertices are in different clusters once the deepest node holding both is split, so a face
+// is left, with its vertices in three clusters, once the deepest of the nodes holding two of its
+// vertices is split. The faces are counted by that node when the cut is made, and a split adds
+// the faces of its node.
+class OctreeCut{
+public:
+    OctreeCut(const LinearOctree &octree, const NodeQuadrics &sums, const std::vector<glm::vec3> &vertices,
+              const std::vector<glm::ivec3> &faces, int numThreads);
 
-void buildVertexLUT(OctreeNode* node, std::unordered_map<int, int>* lut, std::vector<glm::vec3>* octree_vertices, 
-                    int crt_depth, int max_depth, std::vector<glm::vec3>* vertices,
-                    std::vector<Eigen::Matrix4f>* error_metrics);
+    // Split nodes until at least targetFaces faces are left or every node of the cut is a leaf
+    void refine(size_t targetFaces);
+    size_t numFaces() const { return liveFaces; }
+    // Map every vertex to its cluster, lut is indexed by vertex and resized to fit them, and
+    // append a representative per cluster. The clusters are numbered in depth-first order.
+    void extract(std::vector<uint32_t>* lut, std::vector<glm::vec3>* octree_vertices) const;
+
+private:
+    // Find the representatives of up to 8 nodes, the children of one node, and queue those that
+    // have children
+    void solve(const uint32_t *nodes, int count);
+
+    const LinearOctree &octree;
+    const NodeQuadrics &sums;
+    const std::vector<glm::vec3> &vertices;
+    // Indexed by node: the faces a split adds, and for the nodes the cut has reached, the cluster
+    std::vector<uint32_t> nodeFaces;
+    std::vector<glm::vec3> representative;
+    std::vector<uint8_t> solved, isSplit;
+    size_t liveFaces = 0;
+    // Nodes of the cut that have children, by error
+    std::priority_queue<std::pair<QuadricReal, uint32_t>> queue;
+};
 
-#endif
\ No newline at end of file
+#endif
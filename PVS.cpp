@@ -0,0 +1,441 @@
+#include "PVS.h"
+#include "Visibility.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <stdlib.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static uint64_t readVarint(const uint8_t *&data){
+    uint64_t value = 0;
+    int shift = 0;
+    while(*data & 0x80){
+        value |= (uint64_t)(*data++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (uint64_t)(*data++) << shift;
+    return value;
+}
+
+// Flip bits [begin, end) of the row
+static void toggleRange(uint64_t *row, uint32_t begin, uint32_t end){
+    uint32_t firstWord = begin >> 6;
+    uint32_t lastWord = (end - 1) >> 6;
+    uint64_t firstMask = ~0ull << (begin & 63);
+    uint64_t lastMask = ~0ull >> (63 - ((end - 1) & 63));
+    if(firstWord == lastWord){
+        row[firstWord] ^= firstMask & lastMask;
+        return;
+    }
+    row[firstWord] ^= firstMask;
+    for(uint32_t w = firstWord + 1; w < lastWord; w++){
+        row[w] = ~row[w];
+    }
+    row[lastWord] ^= lastMask;
+}
+
+PVS::PVS(){
+    mapping = nullptr;
+    mappingSize = 0;
+    header = nullptr;
+    rowOffsets = nullptr;
+    numCells = 0;
+    numRows = 0;
+    numSectors = 1;
+    rowWords = 0;
+    cellRows.clear();
+}
+
+PVS::~PVS(){
+    unload();
+}
+
+// Map the file into memory and check that it belongs to the given tilemap
+
+bool PVS::load(const char *filename, TileMap &tilemap){
+    if(!open(filename))
+        return false;
+    if(!checkTileMap(*header, tilemap)){
+        printf("[PVS] '%s' does not match the current tilemap\n", filename);
+        unload();
+        return false;
+    }
+    return true;
+}
+
+bool PVS::open(const char *filename){
+    unload();
+
+#ifdef _WIN32
+    // No mmap, read the whole file with a single allocation instead
+    FILE *f = fopen(filename, "rb");
+    if(f == nullptr){
+        printf("[PVS] Cannot open '%s'\n", filename);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t fileSize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    void *data = malloc(fileSize);
+    if(data == nullptr || fread(data, 1, fileSize, f) != fileSize){
+        free(data);
+        fclose(f);
+        printf("[PVS] Cannot read '%s'\n", filename);
+        return false;
+    }
+    fclose(f);
+#else
+    int fd = ::open(filename, O_RDONLY);
+    if(fd < 0){
+        printf("[PVS] Cannot open '%s'\n", filename);
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t fileSize = st.st_size;
+    void *data = (fileSize > 0) ? mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(data == MAP_FAILED){
+        printf("[PVS] Cannot map '%s'\n", filename);
+        return false;
+    }
+#endif
+    mapping = data;
+    mappingSize = fileSize;
+
+    header = (const PVSHeader *)mapping;
+    if(fileSize < sizeof(PVSHeader) || !checkFormat(*header, fileSize)){
+        printf("[PVS] '%s' is not a version %d PVS file\n", filename, PVS_VERSION);
+        unload();
+        return false;
+    }
+
+    numCells = header->width * header->height;
+    numRows = header->numRows;
+    numSectors = header->numSectors;
+    rowWords = header->rowWords;
+    rowOffsets = (const uint64_t *)((const char *)mapping + sizeof(PVSHeader));
+    uint64_t regionsOffset = (rowOffsets[numRows] + numCells + 7) & ~7ull;
+    // Shards hold a range of the rows, the regions are only stored with all of them
+    bool isShard = (header->flags & PVS_FLAG_SHARD) != 0;
+    bool hasRegions = (header->flags & PVS_FLAG_REGIONS) != 0 && !isShard;
+    uint32_t numSources = numRows / numSectors;
+    if(rowOffsets[numRows] + numCells > fileSize || (hasRegions && regionsOffset + numSources * sizeof(PVSRegion) > fileSize)){
+        printf("[PVS] '%s' is truncated\n", filename);
+        unload();
+        return false;
+    }
+
+    if(hasRegions){
+        // Rows are indexed x * height + y like the cells
+        const PVSRegion *regions = (const PVSRegion *)((const char *)mapping + regionsOffset);
+        cellRows.assign(numCells, UINT32_MAX);
+        for(uint32_t r = 0; r < numSources; r++){
+            const PVSRegion &region = regions[r];
+            for(uint32_t x = region.x; x < (uint32_t)region.x + region.width && x < header->width; x++){
+                for(uint32_t y = region.y; y < (uint32_t)region.y + region.height && y < header->height; y++){
+                    cellRows[x * header->height + y] = r;
+                }
+            }
+        }
+        if(std::find(cellRows.begin(), cellRows.end(), UINT32_MAX) != cellRows.end()){
+            printf("[PVS] The regions of '%s' do not cover the map\n", filename);
+            unload();
+            return false;
+        }
+    }
+    else if(numSources != numCells && !isShard){
+        printf("[PVS] '%s' has %u rows for %u cells\n", filename, numSources, numCells);
+        unload();
+        return false;
+    }
+    return true;
+}
+
+void PVS::unload(){
+    if(mapping != nullptr){
+#ifdef _WIN32
+        free(mapping);
+#else
+        munmap(mapping, mappingSize);
+#endif
+    }
+    mapping = nullptr;
+    mappingSize = 0;
+    header = nullptr;
+    rowOffsets = nullptr;
+    numCells = 0;
+    numRows = 0;
+    numSectors = 1;
+    rowWords = 0;
+    cellRows.clear();
+}
+
+const uint64_t *PVS::getRow(uint32_t from, std::vector<uint64_t> &scratch) const{
+    if(from >= numRows)
+        return nullptr;
+    const uint8_t *file = (const uint8_t *)mapping;
+    const uint8_t *data = file + rowOffsets[from];
+    if(data[0] == PVS_ROW_RAW)
+        return (const uint64_t *)(data + 8);
+
+    scratch.assign(rowWords, 0);
+    uint64_t *row = scratch.data();
+    data++;
+    if(file[rowOffsets[from]] == PVS_ROW_XOR){
+        // Start from the reference row, then flip the differing runs
+        uint32_t refIdx = from - (uint32_t)readVarint(data);
+        const uint8_t *ref = file + rowOffsets[refIdx];
+        if(ref[0] == PVS_ROW_RAW)
+            memcpy(row, ref + 8, rowWords * sizeof(uint64_t));
+        else
+            decodeRuns(ref + 1, numCells, row);
+    }
+    decodeRuns(data, numCells, row);
+    return row;
+}
+
+bool PVS::isVisible(uint32_t from, uint32_t to) const{
+    if(from >= numRows || to >= numCells)
+        return false;
+    const uint8_t *file = (const uint8_t *)mapping;
+    const uint8_t *data = file + rowOffsets[from];
+    if(data[0] == PVS_ROW_RAW)
+        return (((const uint64_t *)(data + 8))[to >> 6] >> (to & 63)) & 1;
+    data++;
+    bool visible = false;
+    if(file[rowOffsets[from]] == PVS_ROW_XOR){
+        uint32_t refIdx = from - (uint32_t)readVarint(data);
+        const uint8_t *ref = file + rowOffsets[refIdx];
+        if(ref[0] == PVS_ROW_RAW)
+            visible = (((const uint64_t *)(ref + 8))[to >> 6] >> (to & 63)) & 1;
+        else
+            visible = runsContain(ref + 1, numCells, to);
+    }
+    return visible != runsContain(data, numCells, to);
+}
+
+void PVS::decodeRuns(const uint8_t *data, uint32_t numBits, uint64_t *row){
+    uint32_t pos = 0;
+    bool set = false;
+    while(pos < numBits){
+        uint32_t length = (uint32_t)readVarint(data);
+        if(set && length > 0)
+            toggleRange(row, pos, pos + length);
+        pos += length;
+        set = !set;
+    }
+}
+
+bool PVS::runsContain(const uint8_t *data, uint32_t numBits, uint32_t bit){
+    uint32_t pos = 0;
+    bool set = false;
+    while(pos < numBits){
+        pos += (uint32_t)readVarint(data);
+        if(bit < pos)
+            return set;
+        set = !set;
+    }
+    return false;
+}
+
+bool PVS::isValid(const char *filename, TileMap &tilemap, const VisibilitySettings &settings){
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if(!in.is_open())
+        return false;
+    size_t fileSize = in.tellg();
+    PVSHeader header;
+    in.seekg(0);
+    if(fileSize < sizeof(PVSHeader) || !in.read((char *)&header, sizeof(PVSHeader)))
+        return false;
+    if(!checkFormat(header, fileSize) || !checkTileMap(header, tilemap))
+        return false;
+    if(header.flags != Visibility::fileFlags(settings) || header.numSectors != (uint32_t)std::max(settings.sectors, 1) ||
+       header.maxDistance != settings.maxDistance){
+        printf("[PVS] '%s' was computed with other settings\n", filename);
+        return false;
+    }
+    return true;
+}
+
+bool PVS::checkFormat(const PVSHeader &header, size_t fileSize){
+    uint64_t cells = (uint64_t)header.width * header.height;
+    return header.magic == PVS_MAGIC && header.version == PVS_VERSION && cells > 0 && cells < UINT32_MAX &&
+           header.numRows > 0 && header.numSectors > 0 && header.numRows % header.numSectors == 0 && header.rowWords == wordsPerRow((uint32_t)cells) &&
+           fileSize >= sizeof(PVSHeader) + ((uint64_t)header.numRows + 1) * sizeof(uint64_t) + cells;
+}
+
+bool PVS::checkTileMap(const PVSHeader &header, TileMap &tilemap){
+    return header.width == (uint32_t)tilemap.width && header.height == (uint32_t)tilemap.height &&
+           header.tilemapHash == tilemap.Hash();
+}
+
+void PVS::packRow(const uint8_t *visibilityFlag, uint32_t numCells, uint64_t *row){
+    uint32_t numWords = wordsPerRow(numCells);
+    for(uint32_t w = 0; w < numWords; w++){
+        uint64_t word = 0;
+        uint32_t end = (numCells - w * 64 < 64) ? numCells - w * 64 : 64;
+        for(uint32_t b = 0; b < end; b++){
+            word |= (uint64_t)(visibilityFlag[w * 64 + b] != 0) << b;
+        }
+        row[w] = word;
+    }
+}
+
+PVSWriter::PVSWriter(const char *filename, TileMap &tilemap, uint32_t flags, const std::vector<PVSRegion> &regions,
+                     uint32_t numSectors, float maxDistance) : numSectors(numSectors), regions(regions){
+    numRows = (regions.empty() ? tilemap.width * tilemap.height : (uint32_t)regions.size()) * numSectors;
+    // The previous column is too far back to keep with sectors
+    columnRows = (regions.empty() && numSectors == 1) ? tilemap.height : 1;
+    if(!regions.empty())
+        flags |= PVS_FLAG_REGIONS;
+    begin(filename, tilemap, flags, 0, maxDistance);
+}
+
+PVSWriter::PVSWriter(const char *filename, TileMap &tilemap, uint32_t flags, uint32_t firstRow, uint32_t numRows) : numRows(numRows), numSectors(1){
+    columnRows = (flags & PVS_FLAG_REGIONS) ? 1 : tilemap.height;
+    begin(filename, tilemap, flags | PVS_FLAG_SHARD, firstRow, 0);
+}
+
+void PVSWriter::begin(const char *filename, TileMap &tilemap, uint32_t flags, uint32_t firstRow, float maxDistance){
+    numCells = tilemap.width * tilemap.height;
+    rowWords = PVS::wordsPerRow(numCells);
+    rowsWritten = 0;
+    // Enough rows to reach the previous column and the keyframe it refers to
+    historySize = (2 * columnRows + 2) * numSectors;
+    history.resize((size_t)historySize * rowWords);
+    historyRef.resize(historySize);
+    rowOffsets.resize(numRows + 1, 0);
+    tiles = tilemap.Tiles();
+
+    out.open(filename, std::ios::binary);
+
+    PVSHeader header;
+    memset(&header, 0, sizeof(PVSHeader));
+    header.magic = PVS_MAGIC;
+    header.version = PVS_VERSION;
+    header.width = tilemap.width;
+    header.height = tilemap.height;
+    header.tilemapHash = tilemap.Hash();
+    header.rowWords = rowWords;
+    header.flags = flags;
+    header.numRows = numRows;
+    header.numSectors = numSectors;
+    header.maxDistance = maxDistance;
+    header.firstRow = firstRow;
+    out.write((const char *)&header, sizeof(PVSHeader));
+    // Placeholder for the offsets, filled in by close()
+    out.write((const char *)rowOffsets.data(), rowOffsets.size() * sizeof(uint64_t));
+}
+
+PVSWriter::~PVSWriter(){
+    if(out.is_open())
+        close();
+}
+
+void PVSWriter::writeRow(const uint64_t *row){
+    uint32_t rowIdx = rowsWritten;
+
+    encoded.clear();
+    encoded.push_back(PVS_ROW_RLE);
+    encodeRuns(row, nullptr);
+    bestEncoded.swap(encoded);
+    uint32_t bestRef = rowIdx;
+
+    // Try a delta against the keyframe behind each neighbouring row
+    uint32_t triedRef = UINT32_MAX;
+    uint32_t neighbours[2] = {numSectors, columnRows * numSectors};
+    for(uint32_t distance : neighbours){
+        if(distance > rowIdx)
+            continue;
+        uint32_t refIdx = historyRef[(rowIdx - distance) % historySize];
+        if(refIdx == triedRef || rowIdx - refIdx >= historySize)
+            continue;
+        triedRef = refIdx;
+
+        encoded.clear();
+        encoded.push_back(PVS_ROW_XOR);
+        writeVarint(rowIdx - refIdx);
+        encodeRuns(row, &history[(size_t)(refIdx % historySize) * rowWords]);
+        if(encoded.size() < bestEncoded.size()){
+            bestEncoded.swap(encoded);
+            bestRef = refIdx;
+        }
+    }
+
+    uint64_t offset = out.tellp();
+    if(bestEncoded.size() >= 8 + rowWords * sizeof(uint64_t)){
+        // Incompressible, store the words 8-byte aligned so they can be read in place
+        uint8_t padding[16] = {0};
+        offset = (offset + 7) & ~7ull;
+        out.write((const char *)padding, offset - out.tellp());
+        padding[0] = PVS_ROW_RAW;
+        out.write((const char *)padding, 8);
+        out.write((const char *)row, rowWords * sizeof(uint64_t));
+        bestRef = rowIdx;
+    }
+    else{
+        out.write((const char *)bestEncoded.data(), bestEncoded.size());
+    }
+    rowOffsets[rowIdx] = offset;
+
+    memcpy(&history[(size_t)(rowIdx % historySize) * rowWords], row, rowWords * sizeof(uint64_t));
+    historyRef[rowIdx % historySize] = bestRef;
+    rowsWritten++;
+}
+
+void PVSWriter::close(){
+    rowOffsets[numRows] = out.tellp();
+    out.write((const char *)tiles.data(), tiles.size());
+    if(!regions.empty()){
+        uint8_t padding[8] = {0};
+        out.write((const char *)padding, (8 - (uint64_t)out.tellp() % 8) % 8);
+        out.write((const char *)regions.data(), regions.size() * sizeof(PVSRegion));
+    }
+    uint64_t fileSize = out.tellp();
+    out.seekp(sizeof(PVSHeader));
+    out.write((const char *)rowOffsets.data(), rowOffsets.size() * sizeof(uint64_t));
+    out.close();
+
+    double rawSize = sizeof(PVSHeader) + (double)numRows * rowWords * sizeof(uint64_t);
+    printf("[PVS] Stored %u rows in %.2f MB (%.1fx smaller than the bit matrix)\n",
+           rowsWritten, fileSize / (1024.0 * 1024.0), rawSize / fileSize);
+}
+
+// Append the run lengths of (row ^ reference) to the encoded row
+
+void PVSWriter::encodeRuns(const uint64_t *row, const uint64_t *reference){
+    uint32_t pos = 0;
+    bool set = false;
+    while(pos < numCells){
+        // Find the first bit from pos on that differs from the current run
+        uint32_t w = pos >> 6;
+        uint64_t word = row[w] ^ (reference ? reference[w] : 0);
+        word = (set ? ~word : word) & (~0ull << (pos & 63));
+        while(word == 0 && ++w < rowWords){
+            word = row[w] ^ (reference ? reference[w] : 0);
+            word = set ? ~word : word;
+        }
+        uint32_t next = (w < rowWords) ? w * 64 + countTrailingZeros(word) : numCells;
+        if(next > numCells)
+            next = numCells;
+        writeVarint(next - pos);
+        pos = next;
+        set = !set;
+    }
+}
+
+void PVSWriter::writeVarint(uint64_t value){
+    while(value >= 0x80){
+        encoded.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    encoded.push_back((uint8_t)value);
+}
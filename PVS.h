@@ -0,0 +1,212 @@
+#ifndef PVS_H
+#define PVS_H
+
+#include <stdint.h>
+#include <fstream>
+#include <vector>
+#include "TileMap.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct VisibilitySettings;
+
+#define PVS_MAGIC 0x31535650 // "PVS1"
+#define PVS_VERSION 5
+
+// Header flags
+#define PVS_FLAG_SYMMETRIC 0x1 // isVisible(a, b) == isVisible(b, a)
+#define PVS_FLAG_EXACT 0x2     // Computed by the exact solver instead of ray sampling
+#define PVS_FLAG_ADAPTIVE 0x4  // Computed by the adaptive ray sampling
+#define PVS_FLAG_REGIONS 0x8   // One row per region of cells instead of one per cell
+#define PVS_FLAG_SHARD 0x10    // Rows firstRow to firstRow + numRows of a full file, one per source
+
+// Binary potentially visible set file, one bit per (source cell, target cell) pair:
+//   PVSHeader
+//   numRows + 1 64-bit byte offsets (from the start of the file) of every row and of the end of the rows
+//   numRows rows of numCells bits, each starting with a PVSRowEncoding byte:
+//     PVS_ROW_RAW: 7 padding bytes, then rowWords 64-bit words, bit i set if cell i is visible
+//     PVS_ROW_RLE: varint lengths of alternating runs of clear and set bits, starting with a clear run
+//     PVS_ROW_XOR: varint distance back to a RAW or RLE reference row, then the runs of (row ^ reference)
+//   width * height bytes, the tiles of the map the rows were computed for
+//   with PVS_FLAG_REGIONS, padding to 8 bytes and the PVSRegion of the numRows / numSectors sources
+// Rows are indexed like the visibility precomputation (x * height + y), or by region, times
+// numSectors: row source * numSectors + s holds the visible cells in heading sector s of the source,
+// the directions atan2(y, x) in [s, s + 1) * 2 pi / numSectors. Bits are indexed like the tilemap
+// (x + y * width). The header stores the tilemap dimensions and hash, so a file
+// computed for a different map is rejected. The stored tiles tell which cells an edit of
+// the map changed, so the file can be updated instead of recomputed.
+
+struct PVSHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint64_t tilemapHash;
+    uint32_t rowWords;
+    uint32_t flags;
+    uint32_t numRows;
+    uint32_t numSectors;
+    // Cells farther than this from the source were dropped, 0 if none were
+    float maxDistance;
+    // With PVS_FLAG_SHARD, the row of the full file the first row is
+    uint32_t firstRow;
+};
+
+// Rectangle of cells that share a row: every point of the region sees the cells of the row
+struct PVSRegion {
+    uint16_t x, y, width, height;
+};
+
+enum PVSRowEncoding : uint8_t {
+    PVS_ROW_RAW,
+    PVS_ROW_RLE,
+    PVS_ROW_XOR
+};
+
+inline int countTrailingZeros(uint64_t word){
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+// The file is memory mapped, so loading does no parsing. Raw rows are read straight from the
+// mapping, compressed rows are decoded on demand into a buffer of the caller (a few microseconds),
+// so a loaded PVS holds no decoding state and can be read from any number of threads.
+
+class PVS{
+public:
+    // Iterates over the set bits of one row
+    class CellIterator{
+    public:
+        CellIterator(const uint64_t *row, uint32_t numWords, uint32_t wordIdx) : row(row), numWords(numWords), wordIdx(wordIdx){
+            word = (wordIdx < numWords) ? row[wordIdx] : 0;
+            skipEmptyWords();
+        }
+        uint32_t operator*() const { return wordIdx * 64 + countTrailingZeros(word); }
+        CellIterator &operator++(){
+            word &= word - 1;
+            skipEmptyWords();
+            return *this;
+        }
+        bool operator!=(const CellIterator &other) const { return wordIdx != other.wordIdx || word != other.word; }
+
+    private:
+        void skipEmptyWords(){
+            while(word == 0 && wordIdx < numWords){
+                wordIdx++;
+                word = (wordIdx < numWords) ? row[wordIdx] : 0;
+            }
+        }
+        const uint64_t *row;
+        uint32_t numWords, wordIdx;
+        uint64_t word;
+    };
+
+    struct CellRange{
+        const uint64_t *row;
+        uint32_t numWords;
+        CellIterator begin() const { return CellIterator(row, numWords, 0); }
+        CellIterator end() const { return CellIterator(row, numWords, numWords); }
+    };
+
+    PVS();
+    ~PVS();
+    PVS(const PVS &) = delete;
+    PVS &operator=(const PVS &) = delete;
+
+    bool load(const char *filename, TileMap &tilemap);
+    // Map a file computed for any tilemap, e.g. an older version of the current one
+    bool open(const char *filename);
+    void unload();
+
+    // Row of the region containing the cell (x * height + y), UINT32_MAX outside the map.
+    // With sectors, the row of the first sector, the others follow it.
+    uint32_t rowOfCell(uint32_t cell) const {
+        if(cell >= numCells)
+            return UINT32_MAX;
+        return (cellRows.empty() ? cell : cellRows[cell]) * numSectors;
+    }
+
+    // The bits of the row, nullptr past the last row. Raw rows point into the mapping, compressed
+    // rows are decoded into scratch, so the bits stay valid until scratch is changed or the file unloaded.
+    const uint64_t *getRow(uint32_t row, std::vector<uint64_t> &scratch) const;
+    // Reads the one bit without decoding the row, false past the last row or cell
+    bool isVisible(uint32_t row, uint32_t to) const;
+    CellRange visibleCells(uint32_t row, std::vector<uint64_t> &scratch) const {
+        const uint64_t *bits = getRow(row, scratch);
+        return CellRange{bits, bits != nullptr ? rowWords : 0};
+    }
+    uint32_t getNumCells() const { return numCells; }
+    uint32_t getNumRows() const { return numRows; }
+    uint32_t getNumSectors() const { return numSectors; }
+    float getMaxDistance() const { return header->maxDistance; }
+    uint32_t getFirstRow() const { return header->firstRow; }
+    uint32_t getFlags() const { return header->flags; }
+    // Dimensions and tiles of the map the file was computed for
+    int getWidth() const { return header->width; }
+    int getHeight() const { return header->height; }
+    const uint8_t *getTiles() const { return (const uint8_t *)mapping + rowOffsets[numRows]; }
+
+    // True if the file exists and was computed for this tilemap with the flags, sectors and
+    // distance of these settings
+    static bool isValid(const char *filename, TileMap &tilemap, const VisibilitySettings &settings);
+
+    static uint32_t wordsPerRow(uint32_t numCells) { return (numCells + 63) / 64; }
+    static void packRow(const uint8_t *visibilityFlag, uint32_t numCells, uint64_t *row);
+    // Flips the bits of the set runs in row
+    static void decodeRuns(const uint8_t *data, uint32_t numBits, uint64_t *row);
+    // True if bit is in one of the set runs
+    static bool runsContain(const uint8_t *data, uint32_t numBits, uint32_t bit);
+
+private:
+    static bool checkFormat(const PVSHeader &header, size_t fileSize);
+    static bool checkTileMap(const PVSHeader &header, TileMap &tilemap);
+
+    void *mapping;
+    size_t mappingSize;
+    const PVSHeader *header;
+    const uint64_t *rowOffsets;
+    uint32_t numCells, numRows, numSectors, rowWords;
+    // Region of every cell if the rows are regions
+    std::vector<uint32_t> cellRows;
+};
+
+// Writes the rows of a PVS file in order, picking for each one the smallest of the raw,
+// run-length and XOR-delta encodings. Delta references are the previous row and the row of
+// the previous column (cells (x, y-1) and (x-1, y)), or the keyframes those rows refer to.
+// Regions are written in quadtree order, so only the previous row is a neighbour. With sectors
+// the neighbours are the same sector of the neighbouring sources.
+
+class PVSWriter{
+public:
+    // numSectors rows per cell, or per region if regions is not empty
+    PVSWriter(const char *filename, TileMap &tilemap, uint32_t flags = 0, const std::vector<PVSRegion> &regions = std::vector<PVSRegion>(),
+              uint32_t numSectors = 1, float maxDistance = 0);
+    // Shard of the rows firstRow to firstRow + numRows of a file with one row per source, see PVS_FLAG_SHARD
+    PVSWriter(const char *filename, TileMap &tilemap, uint32_t flags, uint32_t firstRow, uint32_t numRows);
+    ~PVSWriter();
+
+    void writeRow(const uint64_t *row);
+    void close();
+
+private:
+    void begin(const char *filename, TileMap &tilemap, uint32_t flags, uint32_t firstRow, float maxDistance);
+    void encodeRuns(const uint64_t *row, const uint64_t *reference);
+    void writeVarint(uint64_t value);
+
+    std::ofstream out;
+    uint32_t numCells, numRows, numSectors, rowWords, columnRows, historySize, rowsWritten;
+    std::vector<uint64_t> rowOffsets;
+    // Last historySize rows and the reference each was encoded against (itself for keyframes)
+    std::vector<uint64_t> history;
+    std::vector<uint32_t> historyRef;
+    std::vector<uint8_t> encoded, bestEncoded;
+    std::vector<uint8_t> tiles;
+    std::vector<PVSRegion> regions;
+};
+
+#endif
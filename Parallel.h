@@ -0,0 +1,29 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+// Run job(0) to job(numJobs - 1) on up to numThreads threads
+template<typename Job>
+void parallelFor(int numThreads, int numJobs, const Job &job){
+    numThreads = std::min(std::max(numThreads, 1), std::max(numJobs, 1));
+    std::atomic<int> nextJob(0);
+    auto worker = [&](){
+        for(int j = nextJob++; j < numJobs; j = nextJob++){
+            job(j);
+        }
+    };
+    std::vector<std::thread> workers;
+    for(int i = 1; i < numThreads; i++){
+        workers.push_back(std::thread(worker));
+    }
+    worker();
+    for(auto &t : workers){
+        t.join();
+    }
+}
+
+#endif
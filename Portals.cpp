@@ -0,0 +1,311 @@
+#include "Portals.h"
+#include <stdio.h>
+#include <algorithm>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+// Range [first, last] of the directions from eye to the points, as angles from heading. The points
+// must not surround the eye, so they span less than half a turn around their mean direction.
+static void angularRange(const glm::vec2 & eye, float heading, const glm::vec2 * points, int numPoints, float & first, float & last){
+    glm::vec2 mean(0.0f);
+    for(int i = 0; i < numPoints; i++){
+        mean += points[i] - eye;
+    }
+    float centre = atan2(mean.y, mean.x);
+    first = last = 0;
+    for(int i = 0; i < numPoints; i++){
+        float offset = std::remainder(atan2(points[i].y - eye.y, points[i].x - eye.x) - centre, 2 * (float)M_PI);
+        first = std::min(first, offset);
+        last = std::max(last, offset);
+    }
+    float shift = std::remainder(centre - heading, 2 * (float)M_PI);
+    first += shift;
+    last += shift;
+}
+
+// Intersect [low, high] with [first, last] (angles from heading, one turn apart at most). The
+// view cone is less than half a turn wide, so at most one of the turns of [first, last] overlaps it.
+static bool intersectRange(float & low, float & high, float first, float last){
+    for(float shift : {0.0f, -2 * (float)M_PI, 2 * (float)M_PI}){
+        float newLow = std::max(low, first + shift);
+        float newHigh = std::min(high, last + shift);
+        if(newLow <= newHigh){
+            low = newLow;
+            high = newHigh;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add [low, high] to covered, sorted disjoint ranges of directions, and return in pieces the parts
+// of it that were not covered yet. A range of a single direction is a piece unless it is covered.
+static void coverRange(std::vector<glm::vec2> & covered, float low, float high, std::vector<glm::vec2> & pieces){
+    pieces.clear();
+    size_t first = 0;
+    while(first < covered.size() && covered[first].y < low){
+        first++;
+    }
+    size_t last = first;
+    float from = low, mergedLow = low, mergedHigh = high;
+    for(; last < covered.size() && covered[last].x <= high; last++){
+        if(covered[last].x > from)
+            pieces.push_back(glm::vec2(from, covered[last].x));
+        from = std::max(from, covered[last].y);
+        mergedLow = std::min(mergedLow, covered[last].x);
+        mergedHigh = std::max(mergedHigh, covered[last].y);
+    }
+    if(last == first)
+        pieces.push_back(glm::vec2(low, high));
+    else if(from < high)
+        pieces.push_back(glm::vec2(from, high));
+    covered.erase(covered.begin() + first, covered.begin() + last);
+    covered.insert(covered.begin() + first, glm::vec2(mergedLow, mergedHigh));
+}
+
+// Cut the floor into rectangles, largest first, so a room of the map is one rectangle and its
+// doorways and corridors are the thin ones left between the rooms. Every run of cell edges
+// between two rooms is a portal, and so is every corner where two rooms touch diagonally between
+// two walls.
+
+void PortalGraph::build(TileMap & tilemap){
+    width = tilemap.width;
+    height = tilemap.height;
+    cellRoom.assign(width * height, -1);
+    rooms.clear();
+    portals.clear();
+
+    auto freeFloor = [&](int x, int y){
+        return !tilemap.IsWall(x, y) && cellRoom[x + y * width] < 0;
+    };
+    int numFree = 0;
+    for(int y = 0; y < height; y++){
+        for(int x = 0; x < width; x++){
+            numFree += freeFloor(x, y) ? 1 : 0;
+        }
+    }
+    // Free cells above and including every cell of the row, and the columns where the heights
+    // still on the stack start
+    std::vector<int> heights(width);
+    std::vector<glm::ivec2> stack;
+    std::vector<Room> largest;
+    while(numFree > 0){
+        // Largest rectangles of free floor: for every row, the largest ones with their bottom on the row
+        int bestArea = 0;
+        largest.clear();
+        std::fill(heights.begin(), heights.end(), 0);
+        for(int y = 0; y < height; y++){
+            stack.clear();
+            for(int x = 0; x <= width; x++){
+                int h = 0;
+                if(x < width){
+                    heights[x] = freeFloor(x, y) ? heights[x] + 1 : 0;
+                    h = heights[x];
+                }
+                int start = x;
+                while(!stack.empty() && stack.back().y >= h){
+                    glm::ivec2 top = stack.back();
+                    stack.pop_back();
+                    int area = top.y * (x - top.x);
+                    if(area > bestArea){
+                        bestArea = area;
+                        largest.clear();
+                    }
+                    if(area == bestArea)
+                        largest.push_back(Room{top.x, y - top.y + 1, x - top.x, top.y, std::vector<int>()});
+                    start = top.x;
+                }
+                if(h > 0)
+                    stack.push_back(glm::ivec2(start, h));
+            }
+        }
+        // Nothing left is larger, so every one of them still free is a room, as if a pass found it
+        for(const Room & room : largest){
+            bool free = true;
+            for(int j = 0; j < room.height && free; j++){
+                for(int i = 0; i < room.width && free; i++){
+                    free = freeFloor(room.x + i, room.y + j);
+                }
+            }
+            if(!free)
+                continue;
+            for(int j = 0; j < room.height; j++){
+                for(int i = 0; i < room.width; i++){
+                    cellRoom[(room.x + i) + (room.y + j) * width] = (int)rooms.size();
+                }
+            }
+            numFree -= room.width * room.height;
+            rooms.push_back(room);
+        }
+    }
+
+    // Edges across the grid line x = line (vertical) or y = line, between the cells before and after it
+    for(int vertical = 0; vertical < 2; vertical++){
+        int numLines = vertical ? width : height;
+        int lineLength = vertical ? height : width;
+        for(int line = 1; line < numLines; line++){
+            int runStart = 0, runRooms[2] = {-1, -1};
+            for(int i = 0; i <= lineLength; i++){
+                int before = -1, after = -1;
+                if(i < lineLength){
+                    before = vertical ? cellRoom[(line - 1) + i * width] : cellRoom[i + (line - 1) * width];
+                    after = vertical ? cellRoom[line + i * width] : cellRoom[i + line * width];
+                    if(before == after)
+                        before = after = -1;
+                }
+                if(before == runRooms[0] && after == runRooms[1])
+                    continue;
+                if(runRooms[0] >= 0 && runRooms[1] >= 0){
+                    Portal portal;
+                    portal.a = vertical ? glm::vec2(line, runStart) : glm::vec2(runStart, line);
+                    portal.b = vertical ? glm::vec2(line, i) : glm::vec2(i, line);
+                    portal.rooms[0] = runRooms[0];
+                    portal.rooms[1] = runRooms[1];
+                    rooms[runRooms[0]].portals.push_back((int)portals.size());
+                    rooms[runRooms[1]].portals.push_back((int)portals.size());
+                    portals.push_back(portal);
+                }
+                runStart = i;
+                runRooms[0] = before;
+                runRooms[1] = after;
+            }
+        }
+    }
+    // Corners where two floor cells touch diagonally between two walls. Only the single sightline
+    // through the corner passes, but the PVS keeps what it shows, so the walk does too.
+    for(int y = 1; y < height; y++){
+        for(int x = 1; x < width; x++){
+            int cells[4] = {cellRoom[(x - 1) + (y - 1) * width], cellRoom[x + (y - 1) * width],
+                            cellRoom[(x - 1) + y * width], cellRoom[x + y * width]};
+            for(int diagonal = 0; diagonal < 2; diagonal++){
+                int a = cells[diagonal ? 1 : 0], b = cells[diagonal ? 2 : 3];
+                int wallA = cells[diagonal ? 0 : 1], wallB = cells[diagonal ? 3 : 2];
+                if(a < 0 || b < 0 || wallA >= 0 || wallB >= 0)
+                    continue;
+                Portal portal;
+                portal.a = portal.b = glm::vec2(x, y);
+                portal.rooms[0] = a;
+                portal.rooms[1] = b;
+                rooms[a].portals.push_back((int)portals.size());
+                rooms[b].portals.push_back((int)portals.size());
+                portals.push_back(portal);
+            }
+        }
+    }
+    printf("[Portals] %d rooms, %d portals\n", (int)rooms.size(), (int)portals.size());
+}
+
+int PortalGraph::visibleCells(const glm::vec2 & eye, float heading, float halfAngle, std::vector<uint64_t> & row) const{
+    int numCells = width * height;
+    row.assign((numCells + 63) / 64, 0);
+    int x = (int)floor(eye.x), y = (int)floor(eye.y);
+    if(x < 0 || y < 0 || x >= width || y >= height || cellRoom[x + y * width] < 0){
+        // In a wall, draw everything
+        for(int cell = 0; cell < numCells; cell++){
+            row[cell >> 6] |= 1ull << (cell & 63);
+        }
+        return 0;
+    }
+
+    // A sightline crosses a convex room once and leaves it through one portal, so the rooms it
+    // passes do not depend on how the walk reached it. Every room is walked through once for each
+    // range of directions that did not reach it yet, which bounds the walk by the number of
+    // distinct ranges instead of the number of paths through the portals.
+    int startRoom = cellRoom[x + y * width];
+    std::vector<std::vector<glm::vec2>> covered(rooms.size());
+    std::vector<RoomVisit> visits, reached;
+    std::vector<glm::vec2> pieces;
+    covered[startRoom].push_back(glm::vec2(-halfAngle, halfAngle));
+    visits.push_back(RoomVisit{startRoom, -halfAngle, halfAngle});
+    while(!visits.empty()){
+        RoomVisit visit = visits.back();
+        visits.pop_back();
+        leaveRoom(visit, startRoom, eye, heading, reached);
+        for(const RoomVisit & next : reached){
+            coverRange(covered[next.room], next.low, next.high, pieces);
+            for(const glm::vec2 & piece : pieces){
+                visits.push_back(RoomVisit{next.room, piece.x, piece.y});
+            }
+        }
+    }
+
+    int numVisited = 0;
+    for(int room = 0; room < (int)rooms.size(); room++){
+        if(!covered[room].empty()){
+            markCells(room, eye, heading, covered[room], row);
+            numVisited++;
+        }
+    }
+    return numVisited;
+}
+
+// The rooms and directions reached from the room through the portals that leave it away from the
+// eye, narrowing the directions of the visit to the portal
+
+void PortalGraph::leaveRoom(const RoomVisit & visit, int startRoom, const glm::vec2 & eye, float heading, std::vector<RoomVisit> & reached) const{
+    reached.clear();
+    const Room & r = rooms[visit.room];
+    for(int p : r.portals){
+        const Portal & portal = portals[p];
+        int next = (portal.rooms[0] == visit.room) ? portal.rooms[1] : portal.rooms[0];
+        float portalLow = visit.low, portalHigh = visit.high;
+        float first, last;
+
+        if(portal.a == portal.b){
+            // Diagonal corner: the eye must be in the quadrant opposite to the next room
+            const Room & n = rooms[next];
+            float towardX = (n.x >= portal.a.x) ? 1.0f : -1.0f;
+            float towardY = (n.y >= portal.a.y) ? 1.0f : -1.0f;
+            if((portal.a.x - eye.x) * towardX <= 0 || (portal.a.y - eye.y) * towardY <= 0)
+                continue;
+            angularRange(eye, heading, &portal.a, 1, first, last);
+            if(intersectRange(portalLow, portalHigh, first, last))
+                reached.push_back(RoomVisit{next, portalLow, portalHigh});
+            continue;
+        }
+
+        // How far the eye is inside the room from the portal's edge
+        bool vertical = portal.a.x == portal.b.x;
+        float line = vertical ? portal.a.x : portal.a.y;
+        float eyeCoord = vertical ? eye.x : eye.y;
+        float inside = (line == (vertical ? r.x : r.y)) ? eyeCoord - line : line - eyeCoord;
+
+        if(inside == 0){
+            // Standing on the portal of the camera's room: it does not narrow the view
+            float along = vertical ? eye.y : eye.x;
+            float from = vertical ? portal.a.y : portal.a.x, to = vertical ? portal.b.y : portal.b.x;
+            if(visit.room != startRoom || along < from || along > to)
+                continue;
+        }
+        else{
+            glm::vec2 ends[2] = {portal.a, portal.b};
+            angularRange(eye, heading, ends, 2, first, last);
+            if(inside < 0 || !intersectRange(portalLow, portalHigh, first, last))
+                continue;
+        }
+        reached.push_back(RoomVisit{next, portalLow, portalHigh});
+    }
+}
+
+// Mark the cells of the room in the directions of ranges from the eye
+
+void PortalGraph::markCells(int room, const glm::vec2 & eye, float heading, const std::vector<glm::vec2> & ranges, std::vector<uint64_t> & row) const{
+    const Room & r = rooms[room];
+    for(int y = r.y; y < r.y + r.height; y++){
+        for(int x = r.x; x < r.x + r.width; x++){
+            bool visible = eye.x >= x && eye.x <= x + 1 && eye.y >= y && eye.y <= y + 1;
+            if(!visible){
+                glm::vec2 corners[4] = {glm::vec2(x, y), glm::vec2(x + 1, y), glm::vec2(x, y + 1), glm::vec2(x + 1, y + 1)};
+                float first, last;
+                angularRange(eye, heading, corners, 4, first, last);
+                for(size_t i = 0; i < ranges.size() && !visible; i++){
+                    float cellLow = ranges[i].x, cellHigh = ranges[i].y;
+                    visible = intersectRange(cellLow, cellHigh, first, last);
+                }
+            }
+            if(visible)
+                row[(x + y * width) >> 6] |= 1ull << ((x + y * width) & 63);
+        }
+    }
+}
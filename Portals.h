@@ -0,0 +1,56 @@
+#ifndef PORTALS_H
+#define PORTALS_H
+#include <glm/glm.hpp>
+#include <stdint.h>
+#include <vector>
+
+#include "TileMap.h"
+
+// Runtime visibility without a precomputed PVS. The floor is cut into rectangular rooms at load
+// time, largest first, and the edges rooms share are the portals between them. A rectangle of
+// floor is convex, so from anywhere inside it the whole room is in sight; the rooms seen from the
+// camera are found every frame by walking from the camera's room through the portals, narrowing
+// the view cone to the directions that pass through every portal on the way. Corners where two
+// walls touch diagonally are portals of a single direction, so the sightlines squeezing through
+// them are followed like in the PVS.
+
+class PortalGraph{
+public:
+    // A portal is the segment a-b (tile coordinates) on the border of rooms[0] and rooms[1], or the
+    // corner a == b where they touch diagonally
+    struct Portal{
+        glm::vec2 a, b;
+        int rooms[2];
+    };
+    struct Room{
+        int x, y, width, height;
+        std::vector<int> portals;
+    };
+
+    void build(TileMap & tilemap);
+    bool isBuilt() const { return !rooms.empty(); }
+    int getNumRooms() const { return (int)rooms.size(); }
+    int getNumPortals() const { return (int)portals.size(); }
+
+    // Set the bits (x + y * width) of the floor cells seen from eye (tile coordinates) in the
+    // directions heading +- halfAngle (atan2(y, x) angles on the tilemap, halfAngle below pi / 2).
+    // Returns the number of rooms visited.
+    int visibleCells(const glm::vec2 & eye, float heading, float halfAngle, std::vector<uint64_t> & row) const;
+
+private:
+    // Room reached by the directions [low, high] from the eye, as angles from the heading
+    struct RoomVisit{
+        int room;
+        float low, high;
+    };
+    void leaveRoom(const RoomVisit & visit, int startRoom, const glm::vec2 & eye, float heading, std::vector<RoomVisit> & reached) const;
+    void markCells(int room, const glm::vec2 & eye, float heading, const std::vector<glm::vec2> & ranges, std::vector<uint64_t> & row) const;
+
+    int width = 0, height = 0;
+    // Room of every cell (x + y * width), -1 for walls
+    std::vector<int> cellRoom;
+    std::vector<Room> rooms;
+    std::vector<Portal> portals;
+};
+
+#endif
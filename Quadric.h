@@ -0,0 +1,55 @@
+#ifndef QUADRIC_H
+#define QUADRIC_H
+
+#include <glm/glm.hpp>
+
+// Build with QUADRIC_DOUBLE defined to accumulate the quadrics in double precision
+#ifdef QUADRIC_DOUBLE
+typedef double QuadricReal;
+#else
+typedef float QuadricReal;
+#endif
+
+// Smallest determinant of the 3x3 part of a quadric, relative to the cube of its mean eigenvalue,
+// for which its point of least error is used. Below it the quadric is too flat or too straight to
+// have a single point of least error.
+#define QEM_MIN_CONDITION 1e-5
+
+// Error quadric of Garland and Heckbert: the matrix p p^T of a plane p = (a, b, c, d), or a sum
+// of them. It is symmetric, so only the upper triangle is stored, row by row:
+//   q[0] q[1] q[2] q[3]
+//        q[4] q[5] q[6]
+//             q[7] q[8]
+//                  q[9]
+// The operations are flat loops over the 10 values, which the compiler vectorises.
+
+struct Quadric{
+    QuadricReal q[10] = {0};
+
+    static Quadric plane(QuadricReal a, QuadricReal b, QuadricReal c, QuadricReal d){
+        Quadric k;
+        k.q[0] = a * a; k.q[1] = a * b; k.q[2] = a * c; k.q[3] = a * d;
+        k.q[4] = b * b; k.q[5] = b * c; k.q[6] = b * d;
+        k.q[7] = c * c; k.q[8] = c * d;
+        k.q[9] = d * d;
+        return k;
+    }
+
+    Quadric &operator+=(const Quadric &other){
+        for(int i = 0; i < 10; i++){
+            q[i] += other.q[i];
+        }
+        return *this;
+    }
+
+    // v^T Q v for v = (p, 1)
+    QuadricReal error(const glm::vec3 &p) const{
+        QuadricReal x = p.x, y = p.y, z = p.z;
+        return x * (q[0] * x + 2 * (q[1] * y + q[2] * z + q[3]))
+             + y * (q[4] * y + 2 * (q[5] * z + q[6]))
+             + z * (q[7] * z + 2 * q[8])
+             + q[9];
+    }
+};
+
+#endif
@@ -0,0 +1,278 @@
+#include "RayPacket.h"
+#include "Visibility.h"
+#include <algorithm>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RAY_PACKET_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RAY_PACKET_TARGET(isa)
+#else
+// Only these functions are compiled for the extension, the dispatch keeps them off older CPUs
+#define RAY_PACKET_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace{
+
+struct PacketGrid{
+    int width, height;
+    float limitX, limitY;
+    const int32_t * tiles;
+};
+
+#ifdef RAY_PACKET_X86
+
+// The kernels follow castRay line by line, one lane per ray. A lane is active while its ray is
+// walking; the lanes of a packet stop when all of them have left the map or hit a wall.
+
+RAY_PACKET_TARGET("avx2")
+void traceAVX2(const PacketGrid & grid, const float * startX, const float * startY, int numRays, const glm::vec2 & rayDir, glm::ivec2 cell, uint8_t * visibilityFlag){
+    bool walkXDir = glm::abs(rayDir.x) > ray_eps;
+    bool walkYDir = glm::abs(rayDir.y) > ray_eps;
+    int stepX = (rayDir.x >= 0) ? 1 : -1;
+    int stepY = (rayDir.y >= 0) ? 1 : -1;
+
+    const __m256i laneIdx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i allSet = _mm256_set1_epi32(-1);
+    const __m256i mapSizeX = _mm256_set1_epi32(grid.width);
+    const __m256i mapSizeY = _mm256_set1_epi32(grid.height);
+    const __m256i stepXs = _mm256_set1_epi32(stepX);
+    const __m256i stepYs = _mm256_set1_epi32(stepY);
+    const __m256 dirX = _mm256_set1_ps(rayDir.x);
+    const __m256 dirY = _mm256_set1_ps(rayDir.y);
+    const __m256 limitX = _mm256_set1_ps(grid.limitX);
+    const __m256 limitY = _mm256_set1_ps(grid.limitY);
+    const __m256 zeroF = _mm256_setzero_ps();
+    alignas(32) int32_t cellIdx[8];
+
+    visibilityFlag[cell.x + cell.y * grid.width] = 1;
+
+    for(int first = 0; first < numRays; first += 8){
+        __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(numRays - first), laneIdx);
+        __m256 posX = _mm256_maskload_ps(startX + first, active);
+        __m256 posY = _mm256_maskload_ps(startY + first, active);
+        __m256i crtX = _mm256_set1_epi32(cell.x);
+        __m256i crtY = _mm256_set1_epi32(cell.y);
+
+        __m256i walkX = walkXDir ? allSet : zero;
+        __m256i walkY = walkYDir ? allSet : zero;
+        __m256i lineX = _mm256_cvttps_epi32((stepX > 0) ? _mm256_ceil_ps(posX) : _mm256_floor_ps(posX));
+        __m256i lineY = _mm256_cvttps_epi32((stepY > 0) ? _mm256_ceil_ps(posY) : _mm256_floor_ps(posY));
+        __m256 tX = walkXDir ? _mm256_div_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(lineX), posX), dirX) : zeroF;
+        __m256 tY = walkYDir ? _mm256_div_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(lineY), posY), dirY) : zeroF;
+
+        while(true){
+            walkX = _mm256_and_si256(walkX, _mm256_and_si256(_mm256_cmpgt_epi32(lineX, allSet), _mm256_cmpgt_epi32(mapSizeX, lineX)));
+            walkY = _mm256_and_si256(walkY, _mm256_and_si256(_mm256_cmpgt_epi32(lineY, allSet), _mm256_cmpgt_epi32(mapSizeY, lineY)));
+            active = _mm256_and_si256(active, _mm256_or_si256(walkX, walkY));
+            if(_mm256_testz_si256(active, active))
+                break;
+
+            // Take the closest crossing, X lines first on ties
+            __m256i xFirst = _mm256_castps_si256(_mm256_cmp_ps(tX, tY, _CMP_LE_OQ));
+            __m256i crossX = _mm256_and_si256(walkX, _mm256_or_si256(_mm256_andnot_si256(walkY, allSet), xFirst));
+            __m256 t = _mm256_blendv_ps(tY, tX, _mm256_castsi256_ps(crossX));
+            __m256 candidateX = _mm256_add_ps(posX, _mm256_mul_ps(t, dirX));
+            __m256 candidateY = _mm256_add_ps(posY, _mm256_mul_ps(t, dirY));
+
+            // Out of bounds
+            __m256 outside = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(candidateX, zeroF, _CMP_LT_OQ), _mm256_cmp_ps(candidateY, zeroF, _CMP_LT_OQ)),
+                                          _mm256_or_ps(_mm256_cmp_ps(candidateX, limitX, _CMP_GE_OQ), _mm256_cmp_ps(candidateY, limitY, _CMP_GE_OQ)));
+            active = _mm256_andnot_si256(_mm256_castps_si256(outside), active);
+
+            __m256i moveX = _mm256_and_si256(crossX, active);
+            __m256i moveY = _mm256_andnot_si256(crossX, active);
+            crtX = _mm256_add_epi32(crtX, _mm256_and_si256(moveX, stepXs));
+            lineX = _mm256_add_epi32(lineX, _mm256_and_si256(moveX, stepXs));
+            tX = _mm256_blendv_ps(tX, _mm256_div_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(lineX), posX), dirX), _mm256_castsi256_ps(moveX));
+            crtY = _mm256_add_epi32(crtY, _mm256_and_si256(moveY, stepYs));
+            lineY = _mm256_add_epi32(lineY, _mm256_and_si256(moveY, stepYs));
+            tY = _mm256_blendv_ps(tY, _mm256_div_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(lineY), posY), dirY), _mm256_castsi256_ps(moveY));
+
+            // Out of bounds
+            __m256i inside = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(crtX, allSet), _mm256_cmpgt_epi32(mapSizeX, crtX)),
+                                              _mm256_and_si256(_mm256_cmpgt_epi32(crtY, allSet), _mm256_cmpgt_epi32(mapSizeY, crtY)));
+            active = _mm256_and_si256(active, inside);
+            int activeLanes = _mm256_movemask_ps(_mm256_castsi256_ps(active));
+            if(activeLanes == 0)
+                break;
+
+            __m256i cells = _mm256_add_epi32(crtX, _mm256_mullo_epi32(crtY, mapSizeX));
+            _mm256_store_si256((__m256i *)cellIdx, cells);
+            for(int lane = 0; lane < 8; lane++){
+                if(activeLanes & (1 << lane))
+                    visibilityFlag[cellIdx[lane]] = 1;
+            }
+
+            __m256i tile = _mm256_mask_i32gather_epi32(zero, grid.tiles, cells, active, 4);
+            active = _mm256_andnot_si256(_mm256_cmpeq_epi32(tile, zero), active);
+        }
+    }
+}
+
+// Same walk on 4 lanes. SSE has no gathers, so the tiles of the active lanes are read one by one.
+
+RAY_PACKET_TARGET("sse4.1")
+void traceSSE41(const PacketGrid & grid, const float * startX, const float * startY, int numRays, const glm::vec2 & rayDir, glm::ivec2 cell, uint8_t * visibilityFlag){
+    bool walkXDir = glm::abs(rayDir.x) > ray_eps;
+    bool walkYDir = glm::abs(rayDir.y) > ray_eps;
+    int stepX = (rayDir.x >= 0) ? 1 : -1;
+    int stepY = (rayDir.y >= 0) ? 1 : -1;
+
+    const __m128i laneIdx = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i allSet = _mm_set1_epi32(-1);
+    const __m128i mapSizeX = _mm_set1_epi32(grid.width);
+    const __m128i mapSizeY = _mm_set1_epi32(grid.height);
+    const __m128i stepXs = _mm_set1_epi32(stepX);
+    const __m128i stepYs = _mm_set1_epi32(stepY);
+    const __m128 dirX = _mm_set1_ps(rayDir.x);
+    const __m128 dirY = _mm_set1_ps(rayDir.y);
+    const __m128 limitX = _mm_set1_ps(grid.limitX);
+    const __m128 limitY = _mm_set1_ps(grid.limitY);
+    const __m128 zeroF = _mm_setzero_ps();
+    alignas(16) float packetX[4], packetY[4];
+    alignas(16) int32_t cellIdx[4];
+
+    visibilityFlag[cell.x + cell.y * grid.width] = 1;
+
+    for(int first = 0; first < numRays; first += 4){
+        int numLanes = std::min(4, numRays - first);
+        for(int lane = 0; lane < 4; lane++){
+            packetX[lane] = (lane < numLanes) ? startX[first + lane] : 0.0f;
+            packetY[lane] = (lane < numLanes) ? startY[first + lane] : 0.0f;
+        }
+        __m128i active = _mm_cmpgt_epi32(_mm_set1_epi32(numLanes), laneIdx);
+        __m128 posX = _mm_load_ps(packetX);
+        __m128 posY = _mm_load_ps(packetY);
+        __m128i crtX = _mm_set1_epi32(cell.x);
+        __m128i crtY = _mm_set1_epi32(cell.y);
+
+        __m128i walkX = walkXDir ? allSet : zero;
+        __m128i walkY = walkYDir ? allSet : zero;
+        __m128i lineX = _mm_cvttps_epi32((stepX > 0) ? _mm_ceil_ps(posX) : _mm_floor_ps(posX));
+        __m128i lineY = _mm_cvttps_epi32((stepY > 0) ? _mm_ceil_ps(posY) : _mm_floor_ps(posY));
+        __m128 tX = walkXDir ? _mm_div_ps(_mm_sub_ps(_mm_cvtepi32_ps(lineX), posX), dirX) : zeroF;
+        __m128 tY = walkYDir ? _mm_div_ps(_mm_sub_ps(_mm_cvtepi32_ps(lineY), posY), dirY) : zeroF;
+
+        while(true){
+            walkX = _mm_and_si128(walkX, _mm_and_si128(_mm_cmpgt_epi32(lineX, allSet), _mm_cmpgt_epi32(mapSizeX, lineX)));
+            walkY = _mm_and_si128(walkY, _mm_and_si128(_mm_cmpgt_epi32(lineY, allSet), _mm_cmpgt_epi32(mapSizeY, lineY)));
+            active = _mm_and_si128(active, _mm_or_si128(walkX, walkY));
+            if(_mm_testz_si128(active, active))
+                break;
+
+            // Take the closest crossing, X lines first on ties
+            __m128i xFirst = _mm_castps_si128(_mm_cmple_ps(tX, tY));
+            __m128i crossX = _mm_and_si128(walkX, _mm_or_si128(_mm_andnot_si128(walkY, allSet), xFirst));
+            __m128 t = _mm_blendv_ps(tY, tX, _mm_castsi128_ps(crossX));
+            __m128 candidateX = _mm_add_ps(posX, _mm_mul_ps(t, dirX));
+            __m128 candidateY = _mm_add_ps(posY, _mm_mul_ps(t, dirY));
+
+            // Out of bounds
+            __m128 outside = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(candidateX, zeroF), _mm_cmplt_ps(candidateY, zeroF)),
+                                       _mm_or_ps(_mm_cmpge_ps(candidateX, limitX), _mm_cmpge_ps(candidateY, limitY)));
+            active = _mm_andnot_si128(_mm_castps_si128(outside), active);
+
+            __m128i moveX = _mm_and_si128(crossX, active);
+            __m128i moveY = _mm_andnot_si128(crossX, active);
+            crtX = _mm_add_epi32(crtX, _mm_and_si128(moveX, stepXs));
+            lineX = _mm_add_epi32(lineX, _mm_and_si128(moveX, stepXs));
+            tX = _mm_blendv_ps(tX, _mm_div_ps(_mm_sub_ps(_mm_cvtepi32_ps(lineX), posX), dirX), _mm_castsi128_ps(moveX));
+            crtY = _mm_add_epi32(crtY, _mm_and_si128(moveY, stepYs));
+            lineY = _mm_add_epi32(lineY, _mm_and_si128(moveY, stepYs));
+            tY = _mm_blendv_ps(tY, _mm_div_ps(_mm_sub_ps(_mm_cvtepi32_ps(lineY), posY), dirY), _mm_castsi128_ps(moveY));
+
+            // Out of bounds
+            __m128i inside = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(crtX, allSet), _mm_cmpgt_epi32(mapSizeX, crtX)),
+                                           _mm_and_si128(_mm_cmpgt_epi32(crtY, allSet), _mm_cmpgt_epi32(mapSizeY, crtY)));
+            active = _mm_and_si128(active, inside);
+            int activeLanes = _mm_movemask_ps(_mm_castsi128_ps(active));
+            if(activeLanes == 0)
+                break;
+
+            _mm_store_si128((__m128i *)cellIdx, _mm_add_epi32(crtX, _mm_mullo_epi32(crtY, mapSizeX)));
+            int wallLanes = 0;
+            for(int lane = 0; lane < 4; lane++){
+                if(activeLanes & (1 << lane)){
+                    visibilityFlag[cellIdx[lane]] = 1;
+                    if(grid.tiles[cellIdx[lane]] == 0)
+                        wallLanes |= 1 << lane;
+                }
+            }
+            __m128i wall = _mm_cmpgt_epi32(_mm_and_si128(_mm_set1_epi32(wallLanes), _mm_setr_epi32(1, 2, 4, 8)), zero);
+            active = _mm_andnot_si128(wall, active);
+        }
+    }
+}
+
+#endif
+
+}
+
+RayPacketTracer::RayPacketTracer(TileMap & tilemap, RayPacketISA maxISA){
+    isa = std::min(detectISA(), maxISA);
+    width = tilemap.width;
+    height = tilemap.height;
+    // castRay compares the float position with the double mapSize - ray_eps
+    limitX = (float)(width - ray_eps);
+    if(limitX < width - ray_eps)
+        limitX = nextafterf(limitX, (float)width);
+    limitY = (float)(height - ray_eps);
+    if(limitY < height - ray_eps)
+        limitY = nextafterf(limitY, (float)height);
+    std::vector<uint8_t> mapTiles = tilemap.Tiles();
+    tiles.assign(mapTiles.begin(), mapTiles.end());
+}
+
+RayPacketISA RayPacketTracer::detectISA(){
+#if defined(RAY_PACKET_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] >> 19) & 1;
+    // AVX also needs the OS to save the YMM registers
+    bool avx = ((info[2] >> 27) & 1) && ((info[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if(avx && maxLeaf >= 7){
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] >> 5) & 1;
+    }
+    return avx2 ? RAY_PACKET_AVX2 : (sse41 ? RAY_PACKET_SSE41 : RAY_PACKET_SCALAR);
+#elif defined(RAY_PACKET_X86)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return RAY_PACKET_AVX2;
+    if(__builtin_cpu_supports("sse4.1"))
+        return RAY_PACKET_SSE41;
+    return RAY_PACKET_SCALAR;
+#else
+    return RAY_PACKET_SCALAR;
+#endif
+}
+
+const char * RayPacketTracer::isaName(RayPacketISA isa){
+    switch(isa){
+    case RAY_PACKET_AVX2:
+        return "avx2";
+    case RAY_PACKET_SSE41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+void RayPacketTracer::trace(const float * startX, const float * startY, int numRays, const glm::vec2 & rayDir, glm::ivec2 cell, uint8_t * visibilityFlag) const{
+#ifdef RAY_PACKET_X86
+    PacketGrid grid = {width, height, limitX, limitY, tiles.data()};
+    if(isa == RAY_PACKET_AVX2)
+        traceAVX2(grid, startX, startY, numRays, rayDir, cell, visibilityFlag);
+    else if(isa == RAY_PACKET_SSE41)
+        traceSSE41(grid, startX, startY, numRays, rayDir, cell, visibilityFlag);
+#endif
+}
@@ -0,0 +1,42 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+#include <glm/glm.hpp>
+#include <stdint.h>
+#include <vector>
+
+#include "TileMap.h"
+
+enum RayPacketISA{
+    RAY_PACKET_SCALAR,
+    RAY_PACKET_SSE41,
+    RAY_PACKET_AVX2
+};
+
+// Walks packets of rays that share a direction through the tilemap in lockstep, 4 (SSE4.1)
+// or 8 (AVX2) at a time, and flags the cells they cross like Visibility::castRay. Lanes that
+// leave the map or enter a wall are masked off while the others keep stepping. Every lane does
+// the float operations of castRay in the same order, so the flagged cells are the same.
+
+class RayPacketTracer{
+public:
+    // Uses the widest kernel the CPU supports, up to maxISA
+    RayPacketTracer(TileMap & tilemap, RayPacketISA maxISA);
+
+    static RayPacketISA detectISA();
+    static const char * isaName(RayPacketISA isa);
+    RayPacketISA getISA() const { return isa; }
+
+    // Rays start at (startX[i], startY[i]) inside cell. Not available for RAY_PACKET_SCALAR,
+    // the rays are cast one by one then.
+    void trace(const float * startX, const float * startY, int numRays, const glm::vec2 & rayDir, glm::ivec2 cell, uint8_t * visibilityFlag) const;
+
+private:
+    RayPacketISA isa;
+    int width, height;
+    // Smallest floats that fail the bounds test of castRay (x < mapSize - ray_eps, done in double)
+    float limitX, limitY;
+    // Tiles widened to 32 bits, so they can be gathered
+    std::vector<int32_t> tiles;
+};
+
+#endif
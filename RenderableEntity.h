@@ -6,11 +6,13 @@
 #include "PLYReader.h"
 #include <vector>
 #include <string>
+#include <cstdio>
 
 class RenderableEntity{
 
 public:
-    std::vector<int> lodLevels = {6, 7, 9, 10};
+    // Loads path_LOD0.ply, path_LOD1.ply, ... until one is missing, LOD 0 being the coarsest.
+    // Without path_LOD0.ply the entity has no LODs and must not be rendered, see isLoaded.
     RenderableEntity(const char * path, uint8_t id, ShaderProgram &program){
         entityId = id;
         #pragma warning( push )
@@ -19,18 +21,24 @@ public:
         #pragma warning( pop ) 
         TriangleMesh * mesh;
 
-        for(int level : lodLevels){
+        for(int level = 0; ; level++){
             mesh = new TriangleMesh();
             std::string fullPath = path;
             fullPath += "_LOD" + std::to_string(level) + ".ply";
             bool bSuccess = reader.readMesh(fullPath.c_str(), *mesh);
-            if(bSuccess){
-                mesh->sendToOpenGL(program);
-                lods.push_back(mesh);
+            if(!bSuccess){
+                delete mesh;
+                break;
             }
+            mesh->sendToOpenGL(program);
+            lods.push_back(mesh);
         }
-	    
-        
+        if(lods.empty())
+            printf("[ENTITY] '%s_LOD0.ply' is missing, bake the LODs again with 'simplify'\n", path);
+    }
+
+    bool isLoaded() const{
+        return !lods.empty();
     }
 
     uint32_t render(uint8_t lodLevel){
@@ -42,6 +50,10 @@ public:
         return lods[lodLevel]->getTriangleCount();
     }
 
+    int getNumLODs() const{
+        return (int)lods.size();
+    }
+
 
 
 private:
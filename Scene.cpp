@@ -9,6 +9,11 @@
 #include "Scene.h"
 #include "PLYReader.h"
 
+// Cells around the camera whose PVS is requested ahead of time in lazy mode
+#define LAZY_PREFETCH_RADIUS 2
+// Half the horizontal angle in which statues are drawn
+#define FRUSTUM_HALF_ANGLE (M_PI / 3)
+
 Scene::Scene()
 {
 	cube = NULL;
@@ -27,30 +32,24 @@ Scene::~Scene()
 // Initialize the scene. This includes the cube we will use to render
 // the floor and walls, as well as the camera.
 
-void Scene::init(TileMap _tilemap)
+void Scene::init(TileMap _tilemap, const VisibilitySettings &visibilitySettings)
 {
 	initShaders();
 	cube = new TriangleMesh();
 	cube->buildCube();
 	cube->sendToOpenGL(basicProgram);
 	currentTime = 0.0f;
-	tilemap = _tilemap;
+	tilemap = std::move(_tilemap);
 
 	camera.init(glm::vec3(0.f, 0.5f, 2.f));
 
-	// Load cell visibility
-	std::ifstream in("../../map/visibility.txt");
-	for (int i = 0; i < tilemap.height * tilemap.width; i++)
+	// Load cell visibility, or compute it as the camera moves
+	if (visibilitySettings.portals)
+		portalGraph.build(tilemap);
+	else if (!cellVisibility.load("../../map/visibility.pvs", tilemap))
 	{
-		std::vector<uint32_t> tmpBuffer;
-		for (uint32_t pos = 0; pos < tilemap.height * tilemap.width; pos++)
-		{
-			uint32_t tmp;
-			in >> tmp;
-			if (tmp)
-				tmpBuffer.push_back(pos);
-		}
-		cellVisibility.push_back(tmpBuffer);
+		if (!visibilitySettings.lazy || !lazyVisibility.open("../../map/visibility.cache", tilemap, visibilitySettings))
+			cout << "Cell visibility not available, no statues will be rendered" << endl;
 	}
 }
 
@@ -58,9 +57,10 @@ void Scene::init(TileMap _tilemap)
 
 bool Scene::loadMesh(const char *filename, uint8_t id)
 {
+	// The entity is kept without LODs so the others stay in line with object_codes, and is never drawn
 	RenderableEntity *re = new RenderableEntity(filename, id, basicProgram);
 	objects.push_back(re);
-	return true;
+	return re->isLoaded();
 }
 
 void Scene::update(int deltaTime)
@@ -104,16 +104,30 @@ void Scene::render(uint8_t num_instances)
 
 		uint32_t crtTriBudget = 0;
 
-		for (auto visibleCell : cellVisibility[cameraCellIndex])
+		std::vector<uint64_t> candidateRow, decodedRow;
+		PVS::CellRange visibleCells = cellVisibility.visibleCells(cellVisibility.rowOfCell(cameraCellIndex), decodedRow);
+		if (portalGraph.isBuilt())
+		{
+			// Headings are measured like atan2(y, x) on the tilemap, as for the sectors
+			float cameraAngle = M_PI * camera.angleDirection / 180.f;
+			portalGraph.visibleCells(glm::vec2(newx, newz), atan2(cos(cameraAngle), sin(cameraAngle)), FRUSTUM_HALF_ANGLE, candidateRow);
+			visibleCells = PVS::CellRange{candidateRow.data(), (uint32_t)candidateRow.size()};
+		}
+		else if (lazyVisibility.isOpen())
+			visibleCells = lazyVisibleCells(glm::floor(newx), glm::floor(newz), candidateRow);
+		else if (cellVisibility.getNumSectors() > 1)
+			visibleCells = sectorVisibleCells(cameraCellIndex, candidateRow);
+
+		for (uint32_t visibleCell : visibleCells)
 		{
 			int x = visibleCell % tilemap.width;
 			int y = visibleCell / tilemap.width;
-			bool statue = (tilemap.GetTile(x, y) > 0 && tilemap.GetTile(x, y) < 255);
+			bool statue = (tilemap.GetTileNear(x, y) > 0 && tilemap.GetTileNear(x, y) < 255);
 			if (statue)
 			{
 				for (int obj_id = 0; obj_id < objects.size(); obj_id++)
 				{
-					if (object_codes[obj_id] == tilemap.GetTile(x, y))
+					if (object_codes[obj_id] == tilemap.GetTileNear(x, y) && objects[obj_id]->isLoaded())
 					{
 						bool frustumVisible = false;
 						// Test for frustum culling using radar-like method
@@ -129,7 +143,7 @@ void Scene::render(uint8_t num_instances)
 							glm::vec3 objectVector = glm::normalize(glm::vec3(x, 0, y) + cellCorner - camera.position);
 
 							float angle = glm::acos(glm::dot(cameraDirection, objectVector));
-							if(glm::abs(angle) <= M_PI / 3){
+							if(glm::abs(angle) <= FRUSTUM_HALF_ANGLE){
 								frustumVisible = true;
 							}
 						}
@@ -162,17 +176,16 @@ void Scene::render(uint8_t num_instances)
 						  auto [objIdA, distanceA, positionA, lodLevelA] = A;
 						  auto [objIdB, distanceB, positionB, lodLevelB] = B;
 
-						  uint32_t lodExponentA;
-						  lodExponentA = 1 << objects[objIdA]->lodLevels[lodLevelA];
-						  uint32_t lodExponentB;
-						  lodExponentB = 1 << objects[objIdB]->lodLevels[lodLevelB];
-						  return (lodExponentA * distanceA) < (lodExponentB * distanceB);
+						  // The LODs are made for triangle counts, so the detail of one is about the square root of them
+						  float detailA = sqrtf((float)objects[objIdA]->getNumTriangles(lodLevelA));
+						  float detailB = sqrtf((float)objects[objIdB]->getNumTriangles(lodLevelB));
+						  return (detailA * distanceA) < (detailB * distanceB);
 					  });
 
 			for (auto &candidate : renderList)
 			{
 				const auto [objId, distance, position, lodLevel] = candidate;
-				if (lodLevel == objects[objId]->lodLevels.size() - 1) // nothing to improve
+				if (lodLevel == objects[objId]->getNumLODs() - 1) // nothing to improve
 					continue;
 
 				if (crtTriBudget - objects[objId]->getNumTriangles(lodLevel) + objects[objId]->getNumTriangles(lodLevel + 1) <= triangleBudget)
@@ -280,6 +293,80 @@ void Scene::initShaders()
 	fShader.free();
 }
 
+// Gather the heading sectors of the camera cell's PVS that overlap the view cone
+
+PVS::CellRange Scene::sectorVisibleCells(uint32_t cell, std::vector<uint64_t> &row)
+{
+	uint32_t firstRow = cellVisibility.rowOfCell(cell);
+	if (firstRow == UINT32_MAX)
+		return PVS::CellRange{nullptr, 0};
+
+	uint32_t numSectors = cellVisibility.getNumSectors();
+	uint32_t rowWords = PVS::wordsPerRow(cellVisibility.getNumCells());
+	row.assign(rowWords, 0);
+
+	// Sectors are measured like atan2(y, x) on the tilemap, the camera looks along (sin, cos) of its angle
+	float cameraAngle = M_PI * camera.angleDirection / 180.f;
+	float heading = atan2(cos(cameraAngle), sin(cameraAngle));
+	float sectorAngle = 2 * M_PI / numSectors;
+	std::vector<uint64_t> decodedRow;
+	for (uint32_t sector = 0; sector < numSectors; sector++)
+	{
+		float offset = std::remainder((sector + 0.5f) * sectorAngle - heading, 2 * M_PI);
+		if (std::abs(offset) <= FRUSTUM_HALF_ANGLE + sectorAngle / 2)
+		{
+			const uint64_t *sectorRow = cellVisibility.getRow(firstRow + sector, decodedRow);
+			for (uint32_t w = 0; w < rowWords; w++)
+				row[w] |= sectorRow[w];
+		}
+	}
+	return PVS::CellRange{row.data(), rowWords};
+}
+
+// Request the PVS of the cells around the camera and return the one of the camera cell.
+// Until it is computed, draw what the neighbouring cells that are computed see, or everything.
+
+PVS::CellRange Scene::lazyVisibleCells(int x, int y, std::vector<uint64_t> &row)
+{
+	uint32_t numCells = lazyVisibility.getNumCells();
+	uint32_t rowWords = lazyVisibility.getRowWords();
+	auto cellIndex = [&](int cx, int cy) { return (uint32_t)(cx * tilemap.height + cy); };
+	auto insideMap = [&](int cx, int cy) { return cx >= 0 && cy >= 0 && cx < tilemap.width && cy < tilemap.height; };
+
+	for (int dx = -LAZY_PREFETCH_RADIUS; dx <= LAZY_PREFETCH_RADIUS; dx++)
+	{
+		for (int dy = -LAZY_PREFETCH_RADIUS; dy <= LAZY_PREFETCH_RADIUS; dy++)
+		{
+			if (insideMap(x + dx, y + dy) && !tilemap.IsWall(x + dx, y + dy))
+				lazyVisibility.request(cellIndex(x + dx, y + dy), dx == 0 && dy == 0);
+		}
+	}
+	if (insideMap(x, y) && lazyVisibility.getRow(cellIndex(x, y), row))
+		return PVS::CellRange{row.data(), rowWords};
+
+	row.assign(rowWords, 0);
+	bool neighbourReady = false;
+	std::vector<uint64_t> neighbourRow;
+	for (int dx = -1; dx <= 1; dx++)
+	{
+		for (int dy = -1; dy <= 1; dy++)
+		{
+			if ((dx != 0 || dy != 0) && insideMap(x + dx, y + dy) && lazyVisibility.getRow(cellIndex(x + dx, y + dy), neighbourRow))
+			{
+				for (uint32_t w = 0; w < rowWords; w++)
+					row[w] |= neighbourRow[w];
+				neighbourReady = true;
+			}
+		}
+	}
+	if (!neighbourReady)
+	{
+		for (uint32_t cell = 0; cell < numCells; cell++)
+			row[cell >> 6] |= 1ull << (cell & 63);
+	}
+	return PVS::CellRange{row.data(), rowWords};
+}
+
 // Render the room. Both the floor and the walls are instances of the
 // same initial cube scaled and translated to build the room.
 
@@ -292,7 +379,7 @@ void Scene::renderRoom()
 	{
 		for (int x = -1; x <= tilemap.width; x++)
 		{
-			bool floor = (tilemap.GetTile(x, y) > 0);
+			bool floor = !tilemap.IsWall(x, y);
 			if (floor)
 			{
 				basicProgram.setUniform4f("color", 0.5f, 0.5f, 0.55f, 1.0f);
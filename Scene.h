@@ -8,6 +8,10 @@
 #include "TriangleMesh.h"
 #include "TileMap.h"
 #include "RenderableEntity.h"
+#include "PVS.h"
+#include "LazyPVS.h"
+#include "Portals.h"
+#include "Visibility.h"
 #include <vector>
 
 
@@ -22,7 +26,7 @@ public:
 	Scene();
 	~Scene();
 
-	void init(TileMap map);
+	void init(TileMap map, const VisibilitySettings &visibilitySettings);
 	bool loadMesh(const char *filename, uint8_t id);
 	void loadMap(TileMap _map);
 	void update(int deltaTime);
@@ -35,6 +39,8 @@ private:
 	void computeModelViewMatrix();
 	
 	void renderRoom();
+	PVS::CellRange lazyVisibleCells(int x, int y, std::vector<uint64_t> &row);
+	PVS::CellRange sectorVisibleCells(uint32_t cell, std::vector<uint64_t> &row);
 
 private:
   VectorCamera camera;
@@ -42,7 +48,9 @@ private:
 	std::vector<RenderableEntity *> objects;
 	ShaderProgram basicProgram;
 	TileMap tilemap;
-	std::vector<std::vector<uint32_t>> cellVisibility;
+	PVS cellVisibility;
+	LazyPVS lazyVisibility;
+	PortalGraph portalGraph;
 	float currentTime;
 	uint8_t object_codes[5] = {38, 59, 82, 106, 132};
 };
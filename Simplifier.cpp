@@ -1,6 +1,54 @@
 #include "Simplifier.h"
 #include <filesystem>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+
+// Faces or vertices of one job of the error quadrics
+#define QUADRIC_CHUNK (1 << 14)
+// Threads from which the quadrics are gathered through the adjacency rather than scattered from
+// the faces. Building the adjacency and gathering take about four times the time of the scatter
+// on one thread, so it only wins once that work is well spread.
+#define QUADRIC_GATHER_THREADS 8
+
+// Faces remapped by one job of remapFaces
+#define REMAP_CHUNK (1 << 16)
+
+// Replace the vertices of every face by their cluster in lut and drop the faces that became
+// degenerate, keeping the order of the rest. Every chunk of faces is compacted into its own range
+// of scratch by a loop without branches, then the ranges are copied next to each other.
+static void remapFaces(const std::vector<glm::ivec3> &faces, const std::vector<uint32_t> &lut, int numThreads,
+                       std::vector<glm::ivec3> &scratch, std::vector<glm::ivec3> &lod_faces){
+    size_t numFaces = faces.size();
+    int numChunks = (int)((numFaces + REMAP_CHUNK - 1) / REMAP_CHUNK);
+    scratch.resize(numFaces);
+    std::vector<size_t> kept(numChunks + 1, 0);
+    parallelFor(numThreads, numChunks, [&](int chunk){
+        size_t begin = (size_t)chunk * REMAP_CHUNK, end = std::min(begin + REMAP_CHUNK, numFaces);
+        const glm::ivec3 *in = faces.data();
+        glm::ivec3 *out = scratch.data() + begin;
+        const uint32_t *cluster = lut.data();
+        size_t count = 0;
+        for(size_t f = begin; f < end; f++){
+            int tv0 = (int)cluster[in[f][0]], tv1 = (int)cluster[in[f][1]], tv2 = (int)cluster[in[f][2]];
+            // The face is always written, and kept by moving past it
+            out[count] = glm::ivec3(tv0, tv1, tv2);
+            count += (tv0 != tv1) & (tv1 != tv2) & (tv0 != tv2);
+        }
+        kept[chunk + 1] = count;
+    });
+    for(int chunk = 0; chunk < numChunks; chunk++){
+        kept[chunk + 1] += kept[chunk];
+    }
+    lod_faces.resize(kept[numChunks]);
+    parallelFor(numThreads, numChunks, [&](int chunk){
+        std::memcpy(lod_faces.data() + kept[chunk], scratch.data() + (size_t)chunk * REMAP_CHUNK,
+                    (kept[chunk + 1] - kept[chunk]) * sizeof(glm::ivec3));
+    });
+}
 
 bool Simplifier::loadMesh(const char* filename){
     vector<float> newVertices;
@@ -35,57 +83,85 @@ bool Simplifier::loadMesh(const char* filename){
     return 0;
 }
 
-bool Simplifier::computeLODs(int numLODs){
-    int maxOctreeDepth = 10;
-    std::vector<int> LODs = {6, 7, 9, 10}; // 6, 7, 9
-    OctreeNode root;
-    root.bbox[0] = glm::vec3(0.0);
-    root.bbox[1] = glm::vec3(1.0);
-    for(int i=0; i < Simplifier::vertices.size();i++){
-        root.verts_id.push_back(i);
+std::vector<size_t> Simplifier::faceTargets(size_t numFaces, int numLODs, int minFaces){
+    std::vector<size_t> targets(std::max(numLODs, 1), numFaces);
+    double coarsest = std::min((double)std::max(minFaces, 1), (double)numFaces);
+    for(int k = 0; k + 1 < numLODs; k++){
+        targets[k] = (size_t)std::llround(coarsest * std::pow(numFaces / coarsest, (double)k / (numLODs - 1)));
     }
+    return targets;
+}
 
-    processNode(&root, &(Simplifier::vertices), 1, maxOctreeDepth);
-    root.isLeaf = false;
-    std::unordered_map<int, int> vertex_lookup;
+bool Simplifier::computeLODs(int numLODs, const SimplifierSettings &settings){
+    Simplifier::numLODs = std::max(numLODs, 1);
+    removeExtraLODs();
+    std::vector<size_t> targets = faceTargets(Simplifier::faces.size(), Simplifier::numLODs, settings.minFaces);
+    LinearOctree octree;
+    octree.build(Simplifier::vertices, settings.numThreads);
+    // Cluster of every vertex, overwritten by every LOD
+    std::vector<uint32_t> vertex_lookup(Simplifier::vertices.size());
     std::vector<glm::vec3> octree_vertices;
+    std::vector<glm::ivec3> remap_scratch, lod_faces;
     printf("[SIMPLIFIER] Done computing the Octree...\n");
 
     // Compute fundamental error quadrics:
-    std::vector<Eigen::Matrix4f> error_metrics;
-    Eigen::Matrix4f K;
-
-    K << 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0;
-    for(int i=0;i<Simplifier::vertices.size();i++){
-        Eigen::Matrix4f M;
-        M << 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0;
-        error_metrics.push_back(M);
+    // first the plane of every face, one array per coefficient so the arithmetic runs on SIMD
+    // lanes across faces, then the sum of the planes of its faces at every vertex. With enough
+    // threads the sums are gathered through the faces around every vertex, so the vertices are
+    // independent, otherwise the planes are scattered to the vertices of their faces. The faces
+    // are added in ascending order either way, so both give the same quadrics.
+    size_t numFaces = Simplifier::faces.size();
+    size_t numVertices = Simplifier::vertices.size();
+    bool gather = settings.numThreads >= QUADRIC_GATHER_THREADS;
+    // The adjacency is only built when the gather or the edge collapses use it
+    vertex_faces = VertexFaces();
+    if(gather || settings.engine == SIMPLIFIER_EDGE_COLLAPSE)
+        vertex_faces.build(Simplifier::faces, numVertices, settings.numThreads);
+    std::vector<float> plane_a(numFaces), plane_b(numFaces), plane_c(numFaces), plane_d(numFaces);
+    const glm::vec3 *verts = Simplifier::vertices.data();
+    const glm::ivec3 *tris = Simplifier::faces.data();
+    int numChunks = (int)((numFaces + QUADRIC_CHUNK - 1) / QUADRIC_CHUNK);
+    parallelFor(settings.numThreads, numChunks, [&](int chunk){
+        size_t end = std::min((size_t)(chunk + 1) * QUADRIC_CHUNK, numFaces);
+        for(size_t f = (size_t)chunk * QUADRIC_CHUNK; f < end; f++){
+            glm::vec3 p0 = verts[tris[f][0]], p1 = verts[tris[f][1]], p2 = verts[tris[f][2]];
+            float ux = p1.x - p0.x, uy = p1.y - p0.y, uz = p1.z - p0.z;
+            float vx = p2.x - p1.x, vy = p2.y - p1.y, vz = p2.z - p1.z;
+            float a = uy * vz - uz * vy, b = uz * vx - ux * vz, c = ux * vy - uy * vx;
+            float length = std::sqrt(a * a + b * b + c * c);
+            // Faces without area add nothing
+            float scale = (length > 0.0f) ? 1.0f / length : 0.0f;
+            a *= scale; b *= scale; c *= scale;
+            plane_a[f] = a; plane_b[f] = b; plane_c[f] = c;
+            plane_d[f] = -(a * p1.x + b * p1.y + c * p1.z);
+        }
+    });
+    std::vector<Quadric> error_metrics(numVertices);
+    if(gather){
+        numChunks = (int)((numVertices + QUADRIC_CHUNK - 1) / QUADRIC_CHUNK);
+        parallelFor(settings.numThreads, numChunks, [&](int chunk){
+            uint32_t end = (uint32_t)std::min((size_t)(chunk + 1) * QUADRIC_CHUNK, numVertices);
+            for(uint32_t v = (uint32_t)chunk * QUADRIC_CHUNK; v < end; v++){
+                Quadric K;
+                for(const uint32_t *f = vertex_faces.begin(v); f != vertex_faces.end(v); f++){
+                    K += Quadric::plane(plane_a[*f], plane_b[*f], plane_c[*f], plane_d[*f]);
+                }
+                error_metrics[v] = K;
+            }
+        });
     }
-
-    for(glm::ivec3 face : Simplifier::faces){
-        int v0 = face[0]; int v1 = face[1]; int v2 = face[2];
-        K << 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0;
-        glm::vec3 v01 = Simplifier::vertices[v1] - Simplifier::vertices[v0];
-        glm::vec3 v12 = Simplifier::vertices[v2] - Simplifier::vertices[v1];
-        glm::vec3 plane_normal = glm::cross(v01, v12);
-        plane_normal = glm::normalize(plane_normal);
-        float d = -glm::dot(plane_normal, Simplifier::vertices[v1]);
-        float a = plane_normal.x; float b = plane_normal.y; float c = plane_normal.z;
-        K << a*a, a*b, a*c, a*d,
-            b*a, b*b, b*c, b*d,
-            c*a, c*b, c*c, c*d,
-            d*a, d*b, d*c, d*d;
-        error_metrics[v0] += K;
-        error_metrics[v1] += K;
-        error_metrics[v2] += K;
+    else{
+        for(size_t f = 0; f < numFaces; f++){
+            Quadric K = Quadric::plane(plane_a[f], plane_b[f], plane_c[f], plane_d[f]);
+            error_metrics[tris[f][0]] += K;
+            error_metrics[tris[f][1]] += K;
+            error_metrics[tris[f][2]] += K;
+        }
     }
 
     // Check that the quadrics are good, the error should be ~ 0
-    Eigen::Vector4f ve;
     for(int i=0;i<Simplifier::vertices.size();i++){ // Simplifier::vertices.size()
-        glm::vec4 v = glm::vec4(Simplifier::vertices[i], 1.0f);
-        ve(0) = v[0]; ve(1) = v[1]; ve(2) = v[2]; ve(3) = v[3];
-        float err = ve.transpose() * error_metrics[i] * ve;
+        float err = error_metrics[i].error(Simplifier::vertices[i]);
         if(std::abs(err) > 1e-5 )
             std::cout<<i<<" "<<err <<std::endl;
     }
@@ -93,29 +169,8 @@ bool Simplifier::computeLODs(int numLODs){
 
     printf("[SIMPLIFIER] Done computing error quadrics...\n");
 
-    for(auto LOD : LODs){
-        current_node_id = 0;
-        QEM_nodes = 0;
-        vertex_lookup.clear();
-        octree_vertices.clear();
-        buildVertexLUT(&root, &vertex_lookup, &octree_vertices, 1, LOD, &(Simplifier::vertices), &(error_metrics));
-        printf("Nodes using QEM: %d (%.3f %%)\n", QEM_nodes, (float)QEM_nodes / current_node_id * 100);
-
-        vector<glm::ivec3> lod_faces;
-
-        for(glm::ivec3 face : Simplifier::faces){
-            int v0 = face[0]; int v1 = face[1]; int v2 = face[2];
-            int tv0 = vertex_lookup[v0]; int tv1 = vertex_lookup[v1]; int tv2 = vertex_lookup[v2];
-
-            if(tv0 == tv1 || tv1 == tv2 || tv0 == tv2){
-                continue;
-                // Discard triangle as it has become degenerate
-            }
-
-            lod_faces.push_back({tv0, tv1, tv2});
-        }
-
-        // Rescale to original
+    // Rescale the LOD to the original box and write it
+    auto write = [&](int level){
         glm::vec3 scale = {bbox[1][0] - bbox[0][0], bbox[1][1] - bbox[0][1], bbox[1][2] - bbox[0][2]};
         for (auto &vertex : octree_vertices){
             vertex = vertex * (scale * 1.0001f);
@@ -123,20 +178,108 @@ bool Simplifier::computeLODs(int numLODs){
         }
 
         printf("Writing simplified mesh...(scale = (%f, %f, %f))\n", scale.x, scale.y, scale.z);
-        writeSimplifications(octree_vertices, lod_faces, LOD);
+        writeSimplifications(octree_vertices, lod_faces, level);
+    };
+
+    if(settings.engine == SIMPLIFIER_EDGE_COLLAPSE){
+        EdgeCollapse collapser;
+        collapser.init(Simplifier::vertices, Simplifier::faces, vertex_faces, error_metrics, settings.numThreads);
+        // Collapses cannot be undone, so the LODs with the most faces come first
+        for(int level = Simplifier::numLODs - 1; level >= 0; level--){
+            collapser.simplify(targets[level]);
+            printf("[SIMPLIFIER] LOD %d: %d faces (target %d)\n", level, (int)collapser.numFaces(), (int)targets[level]);
+            collapser.extract(octree_vertices, lod_faces);
+            write(level);
+        }
+        return 0;
     }
-    
-    
 
+    // Every LOD refines the cut of the one before, so its clusters come from the nodes with the
+    // most error whatever their depth
+    NodeQuadrics node_quadrics;
+    sumNodeQuadrics(octree, Simplifier::vertices, error_metrics, node_quadrics);
+    OctreeCut cut(octree, node_quadrics, Simplifier::vertices, Simplifier::faces, settings.numThreads);
+
+    for(int level = 0; level < Simplifier::numLODs; level++){
+        if(targets[level] >= Simplifier::faces.size()){
+            // The cut cannot split the leaves, the whole mesh is the original one
+            octree_vertices = Simplifier::vertices;
+            lod_faces = Simplifier::faces;
+            printf("[SIMPLIFIER] LOD %d: %d faces, the whole mesh\n", level, (int)lod_faces.size());
+            write(level);
+            continue;
+        }
+        octree_vertices.clear();
+        cut.refine(targets[level]);
+        cut.extract(&vertex_lookup, &octree_vertices);
+        printf("Nodes using QEM: %d (%.3f %%)\n", QEM_nodes, (float)QEM_nodes / current_node_id * 100);
+
+        remapFaces(Simplifier::faces, vertex_lookup, settings.numThreads, remap_scratch, lod_faces);
+        printf("[SIMPLIFIER] LOD %d: %d faces (target %d)\n", level, (int)lod_faces.size(), (int)targets[level]);
+
+        write(level);
+    }
 
     return 0;
 }
 
-bool Simplifier::writeSimplifications(std::vector<glm::vec3> vertices, std::vector<glm::ivec3> faces, int level){
+bool Simplifier::benchmarkOctree(int maxThreads, int repetitions){
+    printf("[SIMPLIFIER] Octree build of %d vertices, best of %d runs\n", (int)Simplifier::vertices.size(), repetitions);
+    LinearOctree reference;
+    reference.build(Simplifier::vertices, 1);
+    double baseTime = 0;
+    bool identical = true;
+    for(int numThreads = 1; numThreads <= std::max(maxThreads, 1); numThreads *= 2){
+        double best = 0;
+        LinearOctree octree;
+        for(int r = 0; r < std::max(repetitions, 1); r++){
+            auto start = std::chrono::steady_clock::now();
+            octree.build(Simplifier::vertices, numThreads);
+            double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            best = (r == 0) ? time : std::min(best, time);
+        }
+        if(numThreads == 1)
+            baseTime = best;
+        auto sameNode = [](const OctreeNode &a, const OctreeNode &b){
+            return a.begin == b.begin && a.end == b.end && a.firstChild == b.firstChild &&
+                   a.numChildren == b.numChildren && a.depth == b.depth;
+        };
+        bool same = octree.vertexIds() == reference.vertexIds() &&
+                    std::equal(octree.nodes().begin(), octree.nodes().end(), reference.nodes().begin(), reference.nodes().end(), sameNode);
+        identical = identical && same;
+        printf("[SIMPLIFIER] %2d threads: %.3f s, %.2fx%s\n", numThreads, best, baseTime / best, same ? "" : ", DIFFERENT OCTREE");
+    }
+    return identical;
+}
+
+string Simplifier::lodPath(int level) const{
+    filesystem::path p(Simplifier::output_folder);
+    return (p.parent_path() / (p.stem().string() + "_LOD" + std::to_string(level) + p.extension().string())).string();
+}
+
+void Simplifier::removeExtraLODs() const{
     filesystem::path p(Simplifier::output_folder);
-    string fpath = p.parent_path().string() + "/" + 
-                   p.stem().string() + "_LOD"+ std::to_string(level) + 
-                   p.extension().string();
+    string prefix = p.stem().string() + "_LOD";
+    filesystem::path folder = p.parent_path().empty() ? filesystem::path(".") : p.parent_path();
+    std::error_code error;
+    std::vector<filesystem::path> extra;
+    for(const auto &entry : filesystem::directory_iterator(folder, error)){
+        string name = entry.path().filename().string();
+        if(entry.path().extension() != p.extension() || name.compare(0, prefix.size(), prefix) != 0)
+            continue;
+        string number = entry.path().stem().string().substr(prefix.size());
+        if(number.empty() || number.find_first_not_of("0123456789") != string::npos || atoi(number.c_str()) < Simplifier::numLODs)
+            continue;
+        extra.push_back(entry.path());
+    }
+    for(const filesystem::path &path : extra){
+        std::cout << "Removing the extra LOD '" << path.string() << "'..." << std::endl;
+        filesystem::remove(path, error);
+    }
+}
+
+bool Simplifier::writeSimplifications(std::vector<glm::vec3> vertices, std::vector<glm::ivec3> faces, int level){
+    string fpath = lodPath(level);
     std::cout << "Writing verts/faces to '" << fpath << "'..." << std::endl;
     int numVerts = vertices.size();
     int numFaces = faces.size();
@@ -5,10 +5,26 @@
 #include <vector>
 #include <queue>
 #include "Octree.h"
+#include "Adjacency.h"
+#include "EdgeCollapse.h"
 #include <eigen3/Eigen/Dense>
 
 using namespace std;
 
+// Algorithm that makes the LODs: vertex clustering on a cut through the octree, or edge collapses
+enum SimplifierEngine{
+    SIMPLIFIER_CLUSTERING,
+    SIMPLIFIER_EDGE_COLLAPSE
+};
+
+// Options of the LOD generation
+struct SimplifierSettings{
+    int numThreads = 1;
+    SimplifierEngine engine = SIMPLIFIER_CLUSTERING;
+    // Faces of the coarsest LOD. The LODs in between divide the faces by the same ratio each.
+    int minFaces = 1000;
+};
+
 class Simplifier{
 public:
     Simplifier(){}
@@ -19,14 +35,31 @@ public:
     }
 
     bool loadMesh(const char* filename);
-    bool computeLODs(int numLODs);
+    bool computeLODs(int numLODs, const SimplifierSettings &settings);
+    // Time the octree build of the loaded mesh on 1, 2, 4, ... up to maxThreads threads, the best of
+    // repetitions runs each, and check that every thread count builds the same octree
+    bool benchmarkOctree(int maxThreads, int repetitions);
     bool writeSimplifications(std::vector<glm::vec3> vertices, std::vector<glm::ivec3> faces, int level);
 
+    // Faces of every LOD, from the coarsest at LOD 0 to the whole mesh at LOD numLODs - 1
+    static std::vector<size_t> faceTargets(size_t numFaces, int numLODs, int minFaces);
+
+    // Faces around every vertex of the loaded mesh, built by computeLODs when it gathers the
+    // quadrics or collapses edges, and empty otherwise
+    const VertexFaces &adjacency() const { return vertex_faces; }
+
 private:
+    // File of one LOD, next to the loaded mesh
+    string lodPath(int level) const;
+    // Delete the LOD files of the loaded mesh numbered numLODs or more, left by an earlier bake
+    // with more LODs, since the renderer loads every LOD it finds
+    void removeExtraLODs() const;
+
     int numLODs;
     string output_folder;
     vector<glm::vec3> vertices;
     vector<glm::ivec3> faces;
+    VertexFaces vertex_faces;
     glm::vec3 bbox[2];
 };
 
@@ -1,34 +1,99 @@
 #ifndef TILEMAP_H
 #define TILEMAP_H
 #include <stdlib.h>
+#include <stdint.h>
+#include <vector>
 
 // Class to store grayscale tilemap of the scene
+//
+// The tiles are stored with a border of one wall tile on every side, so the neighbours of any
+// tile of the map can be read without bounds checks. A copy of the walls is kept as a bit mask
+// of 8x8 tile blocks, one 64-bit word per block, for the ray walkers: the cells a ray or a
+// neighbourhood test touches are close together in 2D, and usually in the same word.
+// Copies are deep and moves take the tiles over.
 
 class TileMap{
     public:
         int width, height;
-        uint8_t* data;
         TileMap(){
             width = 0;
             height = 0;
-            data = nullptr;
+            stride = 0;
+            blocksX = 0;
         }
-        TileMap(uint8_t* _data, int _width, int _height, int _comp){
-            data = (uint8_t*)malloc(_width * _height);
+        TileMap(const uint8_t* _data, int _width, int _height, int _comp){
             width = _width;
             height = _height;
+            stride = width + 2;
+            blocksX = (stride + 7) / 8;
+            tiles.assign((size_t)stride * (height + 2), 0);
+            wallBlocks.assign((size_t)blocksX * ((height + 2 + 7) / 8), ~0ull);
             // copy one component of the initial image
-            for(int i = 0;i<width*height;i++){
-                data[i] = _data[i * _comp];
+            for(int y = 0; y < height; y++){
+                for(int x = 0; x < width; x++){
+                    SetTile(x, y, _data[(y * width + x) * _comp]);
+                }
             }
         }
 
-        uint8_t GetTile(int x, int y){
-            if(x < 0 || y < 0 || x >= width || y >= height)
+        // 0 (wall) outside the map
+        uint8_t GetTile(int x, int y) const{
+            if((unsigned)x >= (unsigned)width || (unsigned)y >= (unsigned)height)
                 return 0;
+            return tiles[(y + 1) * stride + x + 1];
+        }
+
+        // Unchecked reads, x in [-1, width] and y in [-1, height]: the border is wall
+        uint8_t GetTileNear(int x, int y) const{
+            return tiles[(y + 1) * stride + x + 1];
+        }
+        bool IsWall(int x, int y) const{
+            int px = x + 1, py = y + 1;
+            return (wallBlocks[(px >> 3) + (py >> 3) * blocksX] >> ((px & 7) | (py & 7) << 3)) & 1;
+        }
+
+        void SetTile(int x, int y, uint8_t tile){
+            tiles[(y + 1) * stride + x + 1] = tile;
+            int px = x + 1, py = y + 1;
+            uint64_t bit = 1ull << ((px & 7) | (py & 7) << 3);
+            uint64_t &block = wallBlocks[(px >> 3) + (py >> 3) * blocksX];
+            block = (tile == 0) ? (block | bit) : (block & ~bit);
+        }
 
-            return data[y * width + x];
+        // The tiles without the border, indexed x + y * width
+        std::vector<uint8_t> Tiles() const{
+            std::vector<uint8_t> out((size_t)width * height);
+            for(int y = 0; y < height; y++){
+                for(int x = 0; x < width; x++){
+                    out[(size_t)y * width + x] = GetTileNear(x, y);
+                }
+            }
+            return out;
+        }
+
+        // FNV-1a hash of the dimensions and tiles, used to tie precomputed data to a map
+        uint64_t Hash() const{
+            uint64_t hash = 14695981039346656037ull;
+            auto mix = [&](uint8_t byte){
+                hash = (hash ^ byte) * 1099511628211ull;
+            };
+            for(int i = 0; i < 4; i++){
+                mix((width >> (8 * i)) & 0xff);
+                mix((height >> (8 * i)) & 0xff);
+            }
+            for(int y = 0; y < height; y++){
+                for(int x = 0; x < width; x++){
+                    mix(GetTileNear(x, y));
+                }
+            }
+            return hash;
         }
+
+    private:
+        int stride, blocksX;
+        std::vector<uint8_t> tiles;
+        // Bit (x & 7) + 8 * (y & 7) of block (x / 8, y / 8) is set for walls, in bordered coordinates
+        std::vector<uint64_t> wallBlocks;
 };
 
-#endif
\ No newline at end of file
+#endif
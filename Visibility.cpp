@@ -0,0 +1,1243 @@
+#include "Visibility.h"
+#include "PVS.h"
+#include <vector>
+#include <stdio.h>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <limits.h>
+#include <string>
+#include <fstream>
+#include <memory>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+// Random origins of the rays shot in each direction
+#define RAYS_PER_DIRECTION 100
+
+// Adaptive sampling: every batch shoots ADAPTIVE_ORIGINS rays in each of ADAPTIVE_DIRECTIONS
+// directions, and every silhouette corner of a visible wall gets 2 * ADAPTIVE_CORNER_RAYS rays
+// passing ADAPTIVE_CORNER_MISS beside it
+#define ADAPTIVE_DIRECTIONS 64
+#define ADAPTIVE_ORIGINS 8
+#define ADAPTIVE_CORNER_RAYS 16
+#define ADAPTIVE_CORNER_MISS 1e-3
+// Rays between random points of the source and of every cell next to the visible floor, on top
+// of the rays through their corners
+#define ADAPTIVE_FRONTIER_RAYS 32
+
+// Number of finished rows that may wait for the writer per worker thread
+#define ROWS_IN_FLIGHT 4
+
+// Rounding tolerance of the exact solver: sets of lines of a smaller area, and rows reached by
+// less than this, are taken as the grazing sightlines they come from. Lines through the source
+// have coordinates below 1, so real sets of lines are orders of magnitude larger.
+#define EXACT_EPS 1e-10
+
+// Hands the rows finished out of order to writeRow in order. Rows wait in a ring until all the
+// rows before them are written, and a worker that finished a row too far ahead waits for room,
+// so memory stays bounded.
+
+class RowOrderer{
+public:
+    typedef std::function<void(int row, const uint64_t * bits)> WriteCallback;
+
+    RowOrderer(int firstRow, int numRows, int window, uint32_t rowWords, const WriteCallback & writeRow) :
+        firstRow(firstRow), endRow(firstRow + numRows), nextRow(firstRow), window(window),
+        rows(window, std::vector<uint64_t>(rowWords)), rowReady(window, false), writeRow(writeRow){
+    }
+
+    void store(int row, std::vector<uint64_t> & bits){
+        std::unique_lock<std::mutex> guard(lock);
+        rowFreed.wait(guard, [&](){ return row < nextRow + window; });
+        rows[(row - firstRow) % window].swap(bits);
+        rowReady[(row - firstRow) % window] = true;
+        while(nextRow < endRow && rowReady[(nextRow - firstRow) % window]){
+            writeRow(nextRow, rows[(nextRow - firstRow) % window].data());
+            rowReady[(nextRow - firstRow) % window] = false;
+            nextRow++;
+        }
+        rowFreed.notify_all();
+    }
+
+private:
+    int firstRow, endRow, nextRow, window;
+    std::vector<std::vector<uint64_t>> rows;
+    std::vector<bool> rowReady;
+    WriteCallback writeRow;
+    std::mutex lock;
+    std::condition_variable rowFreed;
+};
+
+void Visibility::computeVisibility(const char* outFile, TileMap & tilemap, const VisibilitySettings & requestedSettings){
+    // Region rows cannot be mirrored into their columns, so regions are never symmetric
+    VisibilitySettings settings = requestedSettings;
+    settings.symmetric = settings.symmetric && settings.regionSize <= 0;
+
+    std::vector<PVSRegion> regions;
+    if(settings.regionSize > 0)
+        buildRegions(tilemap, settings.regionSize, regions);
+    int numSources = regions.empty() ? tilemap.width * tilemap.height : (int)regions.size();
+    printf("Computing cell visibility (%d threads, %s%s%s, %d %s)...\n", glm::clamp(settings.numThreads, 1, numSources),
+           settings.exact ? "exact" : RayPacketTracer::isaName(std::min(RayPacketTracer::detectISA(), settings.simd)),
+           (settings.adaptive && !settings.exact) ? ", adaptive" : "", settings.symmetric ? ", symmetric" : "",
+           numSources, regions.empty() ? "cells" : "regions");
+
+    if(settings.numShards > 1){
+        if(computeShards(outFile, tilemap, settings, regions) && mergeShards(outFile, tilemap, settings, regions))
+            printf("Cell visibility done...\n");
+        return;
+    }
+
+    std::vector<int> sources(numSources);
+    std::iota(sources.begin(), sources.end(), 0);
+    writeVisibility(outFile, tilemap, settings, regions, [&](const RowCallback & storeRow){
+        computeRows(tilemap, settings, regions, sources, storeRow);
+    });
+    printf("Cell visibility done...\n");
+}
+
+// Write the PVS file from the rows of every source, which produceRows hands to its callback in
+// any order. This is where symmetric rows get their columns and rows are split into sectors.
+
+void Visibility::writeVisibility(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions, const std::function<void(const RowCallback &)> & produceRows){
+    int numCells = tilemap.width * tilemap.height;
+    int numSources = regions.empty() ? numCells : (int)regions.size();
+    uint32_t rowWords = PVS::wordsPerRow(numCells);
+    PVSWriter out(outFile, tilemap, fileFlags(settings), regions, std::max(settings.sectors, 1), settings.maxDistance);
+
+    // Rows are split into sectors only when they are written, after the symmetric pass
+    bool split = settings.sectors > 1 || settings.maxDistance > 0;
+    std::vector<uint64_t> sectorRows;
+    auto writeRow = [&](int source, const uint64_t * row){
+        if(!split){
+            out.writeRow(row);
+            return;
+        }
+        PVSRegion region = regions.empty() ? PVSRegion{(uint16_t)(source / tilemap.height), (uint16_t)(source % tilemap.height), 1, 1} : regions[source];
+        splitSectors(region, row, tilemap, settings, sectorRows);
+        for(size_t offset = 0; offset < sectorRows.size(); offset += rowWords){
+            out.writeRow(&sectorRows[offset]);
+        }
+    };
+
+    if(!settings.symmetric){
+        RowOrderer orderer(0, numSources, glm::clamp(settings.numThreads, 1, numSources) * ROWS_IN_FLIGHT, rowWords, writeRow);
+        produceRows([&](int source, std::vector<uint64_t> & row){
+            orderer.store(source, row);
+        });
+    }
+    else{
+        // Every row needs the columns of the rows after it, so keep the whole matrix
+        std::vector<uint64_t> matrix((size_t)numCells * rowWords);
+        produceRows([&](int cell, std::vector<uint64_t> & row){
+            std::copy(row.begin(), row.end(), matrix.begin() + (size_t)cell * rowWords);
+        });
+
+        // Rows are indexed x * height + y and bits x + y * width
+        for(int from = 0; from < numCells; from++){
+            int fromBit = (from / tilemap.height) + (from % tilemap.height) * tilemap.width;
+            PVS::CellRange visible = {&matrix[(size_t)from * rowWords], rowWords};
+            for(uint32_t to : visible){
+                size_t toRow = (size_t)(to % tilemap.width) * tilemap.height + to / tilemap.width;
+                matrix[toRow * rowWords + (fromBit >> 6)] |= 1ull << (fromBit & 63);
+            }
+        }
+        for(int from = 0; from < numCells; from++){
+            writeRow(from, &matrix[(size_t)from * rowWords]);
+        }
+    }
+
+    out.close();
+}
+
+// Sharded precomputation: the sources are cut into settings.numShards ranges, and every range is
+// computed into a PVS file of its own (outFile.shard<k>) that is renamed into place once complete,
+// then listed in the manifest (outFile.shards). A run skips the shards the manifest lists for
+// this map and these settings, so a killed run resumes at the first unfinished shard, and
+// processes sharing the directory can each take other shards (settings.shard).
+
+static std::string shardFile(const char* outFile, int shard){
+    return std::string(outFile) + ".shard" + std::to_string(shard);
+}
+
+static std::string manifestLine(int shard, int numShards, TileMap & tilemap, const VisibilitySettings & settings, uint32_t flags){
+    char line[128];
+    snprintf(line, sizeof(line), "shard %d of %d map %016llx flags %x regions %d converge %d", shard, numShards,
+             (unsigned long long)tilemap.Hash(), flags, settings.regionSize, settings.convergedBatches);
+    return line;
+}
+
+// Shards listed in the manifest whose files are still there
+
+std::vector<bool> Visibility::finishedShards(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, int numSources, int numShards){
+    std::vector<bool> finished(numShards, false);
+    std::ifstream manifest(std::string(outFile) + ".shards");
+    std::string line;
+    while(std::getline(manifest, line)){
+        int shard = -1;
+        if(sscanf(line.c_str(), "shard %d", &shard) != 1 || shard < 0 || shard >= numShards || finished[shard] ||
+           line != manifestLine(shard, numShards, tilemap, settings, fileFlags(settings)))
+            continue;
+        PVS rows;
+        finished[shard] = rows.load(shardFile(outFile, shard).c_str(), tilemap) && (int)rows.getFirstRow() == shardBegin(shard, numSources, numShards) &&
+                          (int)rows.getNumRows() == shardBegin(shard + 1, numSources, numShards) - shardBegin(shard, numSources, numShards);
+    }
+    return finished;
+}
+
+int Visibility::shardBegin(int shard, int numSources, int numShards){
+    return (int)((int64_t)numSources * shard / numShards);
+}
+
+// Compute the unfinished shards given to this process, and return true if every shard is finished
+
+bool Visibility::computeShards(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions){
+    int numSources = regions.empty() ? tilemap.width * tilemap.height : (int)regions.size();
+    int numShards = std::min(settings.numShards, numSources);
+    uint32_t rowWords = PVS::wordsPerRow(tilemap.width * tilemap.height);
+    std::vector<bool> finished = finishedShards(outFile, tilemap, settings, numSources, numShards);
+
+    for(int shard = 0; shard < numShards; shard++){
+        if(finished[shard] || (settings.shard >= 0 && settings.shard != shard))
+            continue;
+        int first = shardBegin(shard, numSources, numShards);
+        int numRows = shardBegin(shard + 1, numSources, numShards) - first;
+        printf("[PVS] Computing shard %d of %d (sources %d to %d)\n", shard, numShards, first, first + numRows - 1);
+
+        std::string file = shardFile(outFile, shard);
+        std::string tmpFile = file + ".tmp";
+        PVSWriter out(tmpFile.c_str(), tilemap, fileFlags(settings), first, numRows);
+        RowOrderer orderer(first, numRows, glm::clamp(settings.numThreads, 1, numRows) * ROWS_IN_FLIGHT, rowWords, [&](int, const uint64_t * row){
+            out.writeRow(row);
+        });
+        std::vector<int> sources(numRows);
+        std::iota(sources.begin(), sources.end(), first);
+        computeRows(tilemap, settings, regions, sources, [&](int source, std::vector<uint64_t> & row){
+            orderer.store(source, row);
+        });
+        out.close();
+
+        remove(file.c_str());
+        std::ofstream manifest(std::string(outFile) + ".shards", std::ios::app);
+        if(rename(tmpFile.c_str(), file.c_str()) != 0 || !(manifest << manifestLine(shard, numShards, tilemap, settings, fileFlags(settings)) << std::endl)){
+            printf("[PVS] Cannot store shard %d\n", shard);
+            return false;
+        }
+    }
+
+    // Other processes may have finished shards in the meantime
+    finished = finishedShards(outFile, tilemap, settings, numSources, numShards);
+    int numFinished = (int)std::count(finished.begin(), finished.end(), true);
+    if(numFinished < numShards){
+        printf("[PVS] %d of %d shards done, the PVS is merged once all of them are\n", numFinished, numShards);
+        return false;
+    }
+    return true;
+}
+
+// Stitch the finished shards into outFile, then delete them and the manifest
+
+bool Visibility::mergeShards(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions){
+    int numSources = regions.empty() ? tilemap.width * tilemap.height : (int)regions.size();
+    int numShards = std::min(settings.numShards, numSources);
+    uint32_t rowWords = PVS::wordsPerRow(tilemap.width * tilemap.height);
+    std::vector<std::unique_ptr<PVS>> shards;
+    for(int shard = 0; shard < numShards; shard++){
+        shards.emplace_back(new PVS());
+        if(!shards.back()->load(shardFile(outFile, shard).c_str(), tilemap)){
+            printf("[PVS] Cannot merge, shard %d is unreadable\n", shard);
+            return false;
+        }
+    }
+
+    writeVisibility(outFile, tilemap, settings, regions, [&](const RowCallback & storeRow){
+        std::vector<uint64_t> row(rowWords), scratch;
+        for(std::unique_ptr<PVS> & shard : shards){
+            for(uint32_t r = 0; r < shard->getNumRows(); r++){
+                const uint64_t * bits = shard->getRow(r, scratch);
+                row.assign(bits, bits + rowWords);
+                storeRow(shard->getFirstRow() + r, row);
+            }
+        }
+    });
+    shards.clear();
+
+    for(int shard = 0; shard < numShards; shard++){
+        remove(shardFile(outFile, shard).c_str());
+    }
+    remove((std::string(outFile) + ".shards").c_str());
+    printf("[PVS] Merged %d shards\n", numShards);
+    return true;
+}
+
+// Every ray (or exact sightline) that differs in the new map reaches an edited tile first, and
+// that tile was flagged in the old row of its source cell. So the rows that did not flag any
+// edited tile are unchanged: the sampling seeds only depend on the cell, and the exact solver
+// decides a pair from the walls along its sightlines (at worst an old row keeps a grazing pair
+// that a new computation would drop). Only walls block sightlines, so other edits change no row.
+
+bool Visibility::updateVisibility(const char* pvsFile, TileMap & tilemap, const VisibilitySettings & settings){
+    // The regions follow the walls, so an edit can move them. Sector rows and rows cut at a
+    // distance no longer hold the cells a row needs to flag the edits that change it
+    if(settings.regionSize > 0 || settings.sectors > 1 || settings.maxDistance > 0)
+        return false;
+
+    PVS oldPVS;
+    if(!oldPVS.open(pvsFile))
+        return false;
+    if(oldPVS.getWidth() != tilemap.width || oldPVS.getHeight() != tilemap.height || oldPVS.getFlags() != fileFlags(settings) ||
+       oldPVS.getNumSectors() != 1 || oldPVS.getMaxDistance() > 0){
+        printf("[PVS] '%s' was computed for other dimensions or settings\n", pvsFile);
+        return false;
+    }
+
+    int mapSizeX = tilemap.width;
+    int mapSizeY = tilemap.height;
+    int numCells = mapSizeX * mapSizeY;
+    uint32_t rowWords = PVS::wordsPerRow(numCells);
+    const uint8_t * oldTiles = oldPVS.getTiles();
+
+    // Tiles that turned into walls or floor. The adaptive sampling aims at the corners of the
+    // walls next to the visible ones, so it watches the neighbours as well
+    std::vector<uint8_t> edited(numCells, 0), watched(numCells, 0);
+    int numEdited = 0;
+    for(int i = 0; i < numCells; i++){
+        if((oldTiles[i] == 0) == tilemap.IsWall(i % mapSizeX, i / mapSizeX))
+            continue;
+        edited[i] = 1;
+        numEdited++;
+        int range = (settings.adaptive && !settings.exact) ? 1 : 0;
+        for(int dy = -range; dy <= range; dy++){
+            for(int dx = -range; dx <= range; dx++){
+                int nx = i % mapSizeX + dx, ny = i / mapSizeX + dy;
+                if(nx >= 0 && ny >= 0 && nx < mapSizeX && ny < mapSizeY)
+                    watched[nx + ny * mapSizeX] = 1;
+            }
+        }
+    }
+    std::vector<uint64_t> watchedMask(rowWords);
+    PVS::packRow(watched.data(), numCells, watchedMask.data());
+
+    // Rows are indexed x * height + y and bits x + y * width
+    std::vector<uint8_t> affected(numCells, 0);
+    std::vector<int> cells;
+    std::vector<uint64_t> scratch;
+    for(int from = 0; from < numCells; from++){
+        int fromBit = (from / mapSizeY) + (from % mapSizeY) * mapSizeX;
+        const uint64_t * row = oldPVS.getRow(from, scratch);
+        bool seesEdit = edited[fromBit] != 0;
+        for(uint32_t w = 0; w < rowWords && !seesEdit; w++){
+            seesEdit = (row[w] & watchedMask[w]) != 0;
+        }
+        if(seesEdit){
+            affected[from] = 1;
+            cells.push_back(from);
+        }
+    }
+
+    std::vector<uint64_t> matrix;
+    std::vector<int> slot(numCells, -1);
+    if(settings.symmetric){
+        // A stored row is the OR of the traced row and its column. The column of an affected cell
+        // needs the traced rows of the cells that saw it, which the old symmetric rows tell.
+        int numAffected = (int)cells.size();
+        for(int i = 0; i < numAffected; i++){
+            for(uint32_t to : oldPVS.visibleCells(cells[i], scratch)){
+                int toRow = (to % mapSizeX) * mapSizeY + to / mapSizeX;
+                if(!affected[toRow] && slot[toRow] < 0){
+                    slot[toRow] = 0;
+                    cells.push_back(toRow);
+                }
+            }
+        }
+        std::sort(cells.begin(), cells.end());
+    }
+    for(int i = 0; i < (int)cells.size(); i++){
+        slot[cells[i]] = i;
+    }
+    printf("[PVS] %d tiles changed, recomputing %d of %d rows\n", numEdited, (int)cells.size(), numCells);
+
+    // Every cell has its own slot, so the workers need no lock
+    std::vector<uint64_t> rows(cells.size() * rowWords);
+    computeRows(tilemap, settings, std::vector<PVSRegion>(), cells, [&](int cell, std::vector<uint64_t> & row){
+        std::copy(row.begin(), row.end(), rows.begin() + (size_t)slot[cell] * rowWords);
+    });
+
+    if(settings.symmetric){
+        // Keep the old bits between unaffected cells, and rebuild the rows and columns of the
+        // affected cells from the traced rows
+        std::vector<uint8_t> affectedBits(numCells, 0);
+        for(int from = 0; from < numCells; from++){
+            affectedBits[(from / mapSizeY) + (from % mapSizeY) * mapSizeX] = affected[from];
+        }
+        std::vector<uint64_t> affectedMask(rowWords);
+        PVS::packRow(affectedBits.data(), numCells, affectedMask.data());
+
+        matrix.resize((size_t)numCells * rowWords);
+        for(int from = 0; from < numCells; from++){
+            uint64_t * row = &matrix[(size_t)from * rowWords];
+            if(affected[from])
+                continue;
+            const uint64_t * oldRow = oldPVS.getRow(from, scratch);
+            for(uint32_t w = 0; w < rowWords; w++){
+                row[w] = oldRow[w] & ~affectedMask[w];
+            }
+        }
+        for(int from : cells){
+            int fromBit = (from / mapSizeY) + (from % mapSizeY) * mapSizeX;
+            PVS::CellRange visible = {&rows[(size_t)slot[from] * rowWords], rowWords};
+            for(uint32_t to : visible){
+                size_t toRow = (size_t)(to % mapSizeX) * mapSizeY + to / mapSizeX;
+                if(!affected[from] && !affected[toRow])
+                    continue;
+                matrix[(size_t)from * rowWords + (to >> 6)] |= 1ull << (to & 63);
+                matrix[toRow * rowWords + (fromBit >> 6)] |= 1ull << (fromBit & 63);
+            }
+        }
+    }
+
+    // The old file stays mapped while the new one is written
+    std::string tmpFile = std::string(pvsFile) + ".tmp";
+    PVSWriter out(tmpFile.c_str(), tilemap, fileFlags(settings));
+    for(int from = 0; from < numCells; from++){
+        if(settings.symmetric)
+            out.writeRow(&matrix[(size_t)from * rowWords]);
+        else if(slot[from] >= 0)
+            out.writeRow(&rows[(size_t)slot[from] * rowWords]);
+        else
+            out.writeRow(oldPVS.getRow(from, scratch));
+    }
+    out.close();
+    oldPVS.unload();
+
+    remove(pvsFile);
+    if(rename(tmpFile.c_str(), pvsFile) != 0){
+        printf("[PVS] Cannot replace '%s'\n", pvsFile);
+        return false;
+    }
+    printf("Cell visibility done...\n");
+    return true;
+}
+
+void Visibility::computeCellRow(int cell, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint64_t * row){
+    int numCells = tilemap.width * tilemap.height;
+    std::vector<uint8_t> visibilityFlag(numCells);
+    computeCellVisibility(cell / tilemap.height, cell % tilemap.height, tilemap, settings, tracer, visibilityFlag.data());
+    PVS::packRow(visibilityFlag.data(), numCells, row);
+}
+
+uint32_t Visibility::fileFlags(const VisibilitySettings & settings){
+    return (settings.symmetric ? PVS_FLAG_SYMMETRIC : 0) | (settings.exact ? PVS_FLAG_EXACT : 0) |
+           (settings.adaptive && !settings.exact ? PVS_FLAG_ADAPTIVE : 0) | (settings.regionSize > 0 ? PVS_FLAG_REGIONS : 0);
+}
+
+Visibility::SamplerSettings Visibility::samplerSettings(const VisibilitySettings & settings){
+    SamplerSettings sampler = {};
+    if(settings.exact)
+        return sampler;
+    if(!settings.adaptive){
+        sampler.raysPerDirection = RAYS_PER_DIRECTION;
+        return sampler;
+    }
+    sampler.convergedBatches = (uint32_t)settings.convergedBatches;
+    sampler.adaptiveDirections = ADAPTIVE_DIRECTIONS;
+    sampler.adaptiveOrigins = ADAPTIVE_ORIGINS;
+    sampler.adaptiveCornerRays = ADAPTIVE_CORNER_RAYS;
+    sampler.adaptiveFrontierRays = ADAPTIVE_FRONTIER_RAYS;
+    sampler.adaptiveCornerMiss = (float)ADAPTIVE_CORNER_MISS;
+    return sampler;
+}
+
+// Split the row of a source into settings.sectors rows by heading. The offsets from the points
+// of the source to the points of a target cell form a box; the cell goes to every sector the box
+// overlaps, so a camera anywhere in the source that looks at any point of the cell reads it.
+// Cells whose box is farther than settings.maxDistance are dropped.
+
+void Visibility::splitSectors(const PVSRegion & source, const uint64_t * row, TileMap & tilemap, const VisibilitySettings & settings, std::vector<uint64_t> & sectorRows){
+    int numSectors = std::max(settings.sectors, 1);
+    uint32_t rowWords = PVS::wordsPerRow(tilemap.width * tilemap.height);
+    double sectorAngle = 2 * M_PI / numSectors;
+    sectorRows.assign((size_t)numSectors * rowWords, 0);
+
+    for(uint32_t to : PVS::CellRange{row, rowWords}){
+        int x = to % tilemap.width;
+        int y = to / tilemap.width;
+        double minX = x - (source.x + source.width), maxX = x + 1 - source.x;
+        double minY = y - (source.y + source.height), maxY = y + 1 - source.y;
+        double nearX = std::max({minX, -maxX, 0.0});
+        double nearY = std::max({minY, -maxY, 0.0});
+        if(settings.maxDistance > 0 && nearX * nearX + nearY * nearY > (double)settings.maxDistance * settings.maxDistance)
+            continue;
+
+        // A box touching the source is seen in every direction. Otherwise it is convex and leaves
+        // out the origin, so its corners span less than half a turn around their centre
+        int firstSector = 0, numCovered = numSectors;
+        if(nearX > 0 || nearY > 0){
+            double centre = atan2(minY + maxY, minX + maxX);
+            double low = 0, high = 0;
+            for(double cornerX : {minX, maxX}){
+                for(double cornerY : {minY, maxY}){
+                    double offset = std::remainder(atan2(cornerY, cornerX) - centre, 2 * M_PI);
+                    low = std::min(low, offset);
+                    high = std::max(high, offset);
+                }
+            }
+            double start = centre + low - 1e-9;
+            start -= 2 * M_PI * std::floor(start / (2 * M_PI));
+            firstSector = std::min((int)(start / sectorAngle), numSectors - 1);
+            numCovered = std::min((int)((start + high - low + 2e-9) / sectorAngle) - firstSector + 1, numSectors);
+        }
+        for(int i = 0; i < numCovered; i++){
+            int sector = (firstSector + i) % numSectors;
+            sectorRows[(size_t)sector * rowWords + (to >> 6)] |= 1ull << (to & 63);
+        }
+    }
+}
+
+// Split the map like a quadtree until the blocks are at most regionSize cells wide and only floor
+// or only walls (a rectangle of floor sees itself, and the camera never is in a wall), or single cells.
+// Blocks are listed in quadtree order, so the rows of neighbouring regions are close in the file.
+
+void Visibility::buildRegions(TileMap & tilemap, int regionSize, std::vector<PVSRegion> & regions){
+    int size = 1;
+    while(size < tilemap.width || size < tilemap.height){
+        size *= 2;
+    }
+    addRegions(tilemap, regionSize, 0, 0, size, regions);
+}
+
+void Visibility::addRegions(TileMap & tilemap, int regionSize, int x, int y, int size, std::vector<PVSRegion> & regions){
+    if(x >= tilemap.width || y >= tilemap.height)
+        return;
+    int width = std::min(size, tilemap.width - x);
+    int height = std::min(size, tilemap.height - y);
+
+    bool uniform = size <= regionSize;
+    bool wall = tilemap.GetTile(x, y) == 0;
+    for(int i = 0; i < width * height && uniform; i++){
+        uniform = (tilemap.GetTile(x + i % width, y + i / width) == 0) == wall;
+    }
+    if(uniform || size == 1){
+        regions.push_back(PVSRegion{(uint16_t)x, (uint16_t)y, (uint16_t)width, (uint16_t)height});
+        return;
+    }
+
+    int half = size / 2;
+    addRegions(tilemap, regionSize, x, y, half, regions);
+    addRegions(tilemap, regionSize, x + half, y, half, regions);
+    addRegions(tilemap, regionSize, x, y + half, half, regions);
+    addRegions(tilemap, regionSize, x + half, y + half, half, regions);
+}
+
+// Compute the packed rows of the given sources on a pool of worker threads. Sources are the cells
+// (row x * height + y), or the regions if there are any. They are handed out in the order of the
+// list, and storeRow is called from the worker that finished the source.
+
+void Visibility::computeRows(TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions, const std::vector<int> & sources, const RowCallback & storeRow){
+    int mapSizeY = tilemap.height;
+    int numCells = tilemap.width * tilemap.height;
+    int numThreads = glm::clamp(settings.numThreads, 1, std::max((int)sources.size(), 1));
+    std::atomic<int> nextSource(0);
+    RayPacketTracer tracer(tilemap, settings.simd);
+    std::vector<int> raysPerRow(regions.empty() ? numCells : regions.size(), 0);
+
+    auto worker = [&](){
+        std::vector<uint8_t> visibilityFlag(numCells), cellFlag;
+        std::vector<uint64_t> packedRow(PVS::wordsPerRow(numCells));
+        while(true){
+            int next = nextSource++;
+            if(next >= (int)sources.size())
+                break;
+            int row = sources[next];
+            if(regions.empty())
+                raysPerRow[row] = computeCellVisibility(row / mapSizeY, row % mapSizeY, tilemap, settings, tracer, visibilityFlag.data());
+            else
+                raysPerRow[row] = computeRegionVisibility(regions[row], tilemap, settings, tracer, visibilityFlag.data(), cellFlag);
+            PVS::packRow(visibilityFlag.data(), numCells, packedRow.data());
+            storeRow(row, packedRow);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for(int i = 0; i < numThreads; i++){
+        workers.push_back(std::thread(worker));
+    }
+    for(auto & t : workers){
+        t.join();
+    }
+
+    if(!settings.exact && !sources.empty())
+        reportRays(tilemap, settings, regions, sources, raysPerRow);
+}
+
+// Print how many rays the sampling took per row, and write them to settings.rayReport
+
+void Visibility::reportRays(TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions, const std::vector<int> & sources, const std::vector<int> & raysPerRow){
+    int mapSizeY = tilemap.height;
+    long long totalRays = 0;
+    int minRays = INT_MAX, maxRays = 0;
+    for(int row : sources){
+        totalRays += raysPerRow[row];
+        minRays = std::min(minRays, raysPerRow[row]);
+        maxRays = std::max(maxRays, raysPerRow[row]);
+    }
+    printf("[PVS] Traced %lld rays, %.0f per %s (min %d, max %d)\n", totalRays, (double)totalRays / sources.size(),
+           regions.empty() ? "cell" : "region", minRays, maxRays);
+
+    if(settings.rayReport == nullptr)
+        return;
+    FILE *report = fopen(settings.rayReport, "w");
+    if(report == nullptr){
+        printf("[PVS] Cannot write '%s'\n", settings.rayReport);
+        return;
+    }
+    fprintf(report, "x y width height rays\n");
+    for(int row : sources){
+        PVSRegion region = regions.empty() ? PVSRegion{(uint16_t)(row / mapSizeY), (uint16_t)(row % mapSizeY), 1, 1} : regions[row];
+        fprintf(report, "%d %d %d %d %d\n", region.x, region.y, region.width, region.height, raysPerRow[row]);
+    }
+    fclose(report);
+}
+
+// Compute the cells seen from any point of a region, and return the number of rays shot. The
+// sampler spreads its origins over the region: every cell of the region shoots its share of
+// RAYS_PER_DIRECTION * (region side) origins per direction, since the shadows seen from a region
+// are about as long as it is wide. The exact and adaptive strategies only handle single cells,
+// so their region rows are the union of the rows of the cells.
+
+int Visibility::computeRegionVisibility(const PVSRegion & region, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint8_t * visibilityFlag, std::vector<uint8_t> & cellFlag){
+    if(region.width == 1 && region.height == 1)
+        return computeCellVisibility(region.x, region.y, tilemap, settings, tracer, visibilityFlag);
+
+    int mapSizeY = tilemap.height;
+    int numCells = tilemap.width * tilemap.height;
+
+    for(int i = 0; i < numCells; i++){
+        visibilityFlag[i] = 0;
+    }
+
+    int numRays = 0;
+    if(settings.exact || settings.adaptive){
+        cellFlag.resize(numCells);
+        for(int x = region.x; x < region.x + region.width; x++){
+            for(int y = region.y; y < region.y + region.height; y++){
+                numRays += computeCellVisibility(x, y, tilemap, settings, tracer, cellFlag.data());
+                for(int i = 0; i < numCells; i++){
+                    visibilityFlag[i] |= cellFlag[i];
+                }
+            }
+        }
+        return numRays;
+    }
+
+    std::seed_seq seed{(uint32_t)(region.x * mapSizeY + region.y)};
+    std::default_random_engine generator(seed);
+    std::uniform_real_distribution<float> randDist(0.0 + ray_eps, 1.0 - ray_eps);
+
+    int area = region.width * region.height;
+    int originsPerCell = (RAYS_PER_DIRECTION * std::max(region.width, region.height) + area - 1) / area;
+    std::vector<float> startX(originsPerCell), startY(originsPerCell);
+
+    for(float theta = 0; theta < 2 * M_PI; theta+=(2 * M_PI / 800)){
+        glm::vec2 rayDir = glm::normalize(glm::vec2(glm::sin(theta), glm::cos(theta)));
+        for(int x = region.x; x < region.x + region.width; x++){
+            for(int y = region.y; y < region.y + region.height; y++){
+                for(int samplePoint = 0; samplePoint < originsPerCell; samplePoint++){
+                    startX[samplePoint] = x + randDist(generator);
+                    startY[samplePoint] = y + randDist(generator);
+                }
+                traceRays(startX.data(), startY.data(), originsPerCell, rayDir, glm::ivec2(x, y), tilemap, tracer, visibilityFlag);
+                numRays += originsPerCell;
+            }
+        }
+    }
+    return numRays;
+}
+
+// Compute for one source cell the visibility to every other cell, and return the number of
+// rays shot. The random engine is seeded from the cell index, so the result is the same
+// whichever thread runs it.
+
+int Visibility::computeCellVisibility(int x, int y, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint8_t * visibilityFlag){
+    if(settings.exact){
+        computeCellVisibilityExact(x, y, tilemap, visibilityFlag);
+        return 0;
+    }
+    if(settings.adaptive)
+        return computeCellVisibilityAdaptive(x, y, tilemap, settings, tracer, visibilityFlag);
+
+    int mapSizeX = tilemap.width;
+    int mapSizeY = tilemap.height;
+
+    for(int i=0;i<mapSizeX * mapSizeY; i++){
+        visibilityFlag[i] = 0;
+    }
+
+    std::seed_seq seed{(uint32_t)(x * mapSizeY + y)};
+    std::default_random_engine generator(seed);
+    std::uniform_real_distribution<float> randDist(0.0 + ray_eps, 1.0 - ray_eps);
+
+    float startX[RAYS_PER_DIRECTION], startY[RAYS_PER_DIRECTION];
+    int numRays = 0;
+
+    // In symmetric mode the other half of the circle is covered by the rays of the other cells
+    double maxTheta = settings.symmetric ? M_PI : 2 * M_PI;
+    for(float theta = 0; theta < maxTheta; theta+=(2 * M_PI / 800)){
+        // Uniform structured sample of rays from the current cell
+        glm::vec2 rayDir = glm::normalize(glm::vec2(glm::sin(theta), glm::cos(theta)));
+
+        for(int samplePoint = 0; samplePoint < RAYS_PER_DIRECTION; samplePoint++){
+            // Uniform random sampling of points inside the cess from which to shoot the rays from
+
+            glm::vec2 startPos(x + randDist(generator), y + randDist(generator));
+            startX[samplePoint] = startPos.x;
+            startY[samplePoint] = startPos.y;
+        }
+        traceRays(startX, startY, RAYS_PER_DIRECTION, rayDir, glm::ivec2(x, y), tilemap, tracer, visibilityFlag);
+        numRays += RAYS_PER_DIRECTION;
+    }
+    return numRays;
+}
+
+// Base 2 radical inverse and second Sobol dimension of n, as 32-bit fractions. Blocks of
+// 2^k consecutive points starting at a multiple of 2^k put one point in each of 2^k
+// equal boxes of the unit square, whatever the box shape.
+
+static uint32_t radicalInverse(uint32_t n){
+    n = (n << 16) | (n >> 16);
+    n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
+    n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
+    n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
+    n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
+    return n;
+}
+
+static uint32_t sobol2(uint32_t n){
+    uint32_t result = 0;
+    for(uint32_t v = 1u << 31; n != 0; n >>= 1, v ^= v >> 1){
+        if(n & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+// Maps a 32-bit fraction to the inside of a cell, with the margin of the random origins
+static float cellOffset(uint32_t fraction){
+    return (float)(ray_eps + (1.0 - 2 * ray_eps) * (fraction / 4294967296.0));
+}
+
+// Sample the cell in batches of rays over stratified directions and Sobol origins, until
+// settings.convergedBatches batches in a row add no visible cell or the rays of the dense
+// sampling are spent. Then shoot rays past the silhouette corners of the visible walls and at
+// the cells bordering the visible floor, which the batches only find by chance, and sample
+// again while they find new cells. Like any sampling it only finds visible pairs, and can miss a
+// few of those the dense sampling finds, about 3 in 100000 on maps of rooms.
+
+int Visibility::computeCellVisibilityAdaptive(int x, int y, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint8_t * visibilityFlag){
+    int mapSizeX = tilemap.width;
+    int mapSizeY = tilemap.height;
+    int numCells = mapSizeX * mapSizeY;
+
+    for(int i = 0; i < numCells; i++){
+        visibilityFlag[i] = 0;
+    }
+
+    // Random digital shifts of the origins, so that the cells do not all use the same points
+    std::seed_seq seed{(uint32_t)(x * mapSizeY + y)};
+    std::mt19937 generator(seed);
+    uint32_t shiftX = generator();
+    uint32_t shiftY = generator();
+
+    double maxTheta = settings.symmetric ? M_PI : 2 * M_PI;
+    int numDirections = settings.symmetric ? 400 : 800;
+    int maxBatches = numDirections * RAYS_PER_DIRECTION / (ADAPTIVE_DIRECTIONS * ADAPTIVE_ORIGINS);
+    std::vector<uint8_t> cornerTested((mapSizeX + 1) * (mapSizeY + 1), 0);
+    std::vector<glm::ivec2> corners;
+    std::vector<uint8_t> frontierTested(numCells, 0);
+    float startX[ADAPTIVE_ORIGINS], startY[ADAPTIVE_ORIGINS];
+    int numRays = 0;
+    int numVisible = 0;
+    int batch = 0;
+
+    while(true){
+        int quietBatches = 0;
+        while(batch < maxBatches && quietBatches < settings.convergedBatches){
+            // Every batch rotates the directions by the next radical inverse, so they keep
+            // filling the largest gaps between the directions of the previous batches
+            double rotation = radicalInverse(batch) / 4294967296.0;
+            for(int d = 0; d < ADAPTIVE_DIRECTIONS; d++){
+                float theta = (float)(maxTheta * (d + rotation) / ADAPTIVE_DIRECTIONS);
+                glm::vec2 rayDir = glm::normalize(glm::vec2(glm::sin(theta), glm::cos(theta)));
+                for(int i = 0; i < ADAPTIVE_ORIGINS; i++){
+                    uint32_t n = (batch * ADAPTIVE_DIRECTIONS + d) * ADAPTIVE_ORIGINS + i;
+                    startX[i] = x + cellOffset(radicalInverse(n) ^ shiftX);
+                    startY[i] = y + cellOffset(sobol2(n) ^ shiftY);
+                }
+                traceRays(startX, startY, ADAPTIVE_ORIGINS, rayDir, glm::ivec2(x, y), tilemap, tracer, visibilityFlag);
+            }
+            numRays += ADAPTIVE_DIRECTIONS * ADAPTIVE_ORIGINS;
+            batch++;
+
+            int visible = (int)std::count(visibilityFlag, visibilityFlag + numCells, 1);
+            quietBatches = (visible == numVisible) ? quietBatches + 1 : 0;
+            numVisible = visible;
+        }
+
+        numRays += traceCorners(x, y, shiftX, shiftY, tilemap, cornerTested, corners, visibilityFlag);
+        numRays += traceFrontier(x, y, shiftX, shiftY, tilemap, corners, frontierTested, visibilityFlag);
+        int visible = (int)std::count(visibilityFlag, visibilityFlag + numCells, 1);
+        if(visible == numVisible)
+            break;
+        numVisible = visible;
+    }
+    return numRays;
+}
+
+// Middle of the chord of the line o + t * dir through the cell, false if the line misses it
+static bool chordMiddle(glm::ivec2 cell, const glm::dvec2 & o, const glm::dvec2 & dir, glm::dvec2 & middle){
+    double t0 = -HUGE_VAL, t1 = HUGE_VAL;
+    for(int axis = 0; axis < 2; axis++){
+        if(dir[axis] == 0){
+            if(o[axis] <= cell[axis] || o[axis] >= cell[axis] + 1)
+                return false;
+            continue;
+        }
+        double ta = (cell[axis] - o[axis]) / dir[axis];
+        double tb = (cell[axis] + 1 - o[axis]) / dir[axis];
+        t0 = glm::max(t0, glm::min(ta, tb));
+        t1 = glm::min(t1, glm::max(ta, tb));
+    }
+    if(t1 - t0 < 1e-6)
+        return false;
+    middle = o + dir * ((t0 + t1) / 2);
+    return true;
+}
+
+// Whether the half-line from a grid corner in direction dir starts inside a wall. Along a grid line
+// it runs between two tiles, and a ray beside it is only sure to be blocked if both are walls.
+static bool entersWall(TileMap & tilemap, glm::ivec2 corner, const glm::dvec2 & dir){
+    int tileX = corner.x - (dir.x < 0), tileY = corner.y - (dir.y < 0);
+    if(dir.x == 0)
+        return tilemap.IsWall(corner.x - 1, tileY) && tilemap.IsWall(corner.x, tileY);
+    if(dir.y == 0)
+        return tilemap.IsWall(tileX, corner.y - 1) && tilemap.IsWall(tileX, corner.y);
+    return tilemap.IsWall(tileX, tileY);
+}
+
+// Shoot rays from the source cell just beside the corners of the visible walls where the wall
+// outline turns (one wall out of the four tiles around the corner, or two diagonal ones): rays
+// aimed at each new corner, and rays along the lines through two corners that cross the source
+// cell. These lines bound the narrow bundles of sightlines squeezing between two walls, which
+// random rays rarely find. Only the lines that graze the walls at their corners can bound such a
+// bundle, the others run into a wall next to a corner along with every ray beside them, so they
+// are skipped before any ray is cast. Returns the number of rays.
+
+int Visibility::traceCorners(int x, int y, uint32_t shiftX, uint32_t shiftY, TileMap & tilemap, std::vector<uint8_t> & cornerTested, std::vector<glm::ivec2> & corners, uint8_t * visibilityFlag){
+    int mapSizeX = tilemap.width;
+    int mapSizeY = tilemap.height;
+    int numRays = 0;
+    int firstNew = (int)corners.size();
+
+    for(int cell = 0; cell < mapSizeX * mapSizeY; cell++){
+        int wallX = cell % mapSizeX, wallY = cell / mapSizeX;
+        if(!visibilityFlag[cell] || !tilemap.IsWall(wallX, wallY))
+            continue;
+
+        for(int i = 0; i < 4; i++){
+            int cornerX = wallX + (i & 1), cornerY = wallY + (i >> 1);
+            uint8_t & tested = cornerTested[cornerX + cornerY * (mapSizeX + 1)];
+            if(tested)
+                continue;
+            tested = 1;
+
+            bool wall00 = tilemap.IsWall(cornerX - 1, cornerY - 1);
+            bool wall10 = tilemap.IsWall(cornerX, cornerY - 1);
+            bool wall01 = tilemap.IsWall(cornerX - 1, cornerY);
+            bool wall11 = tilemap.IsWall(cornerX, cornerY);
+            int numWalls = wall00 + wall10 + wall01 + wall11;
+            if(numWalls == 1 || (numWalls == 2 && wall00 == wall11))
+                corners.push_back(glm::ivec2(cornerX, cornerY));
+        }
+    }
+
+    for(int c = firstNew; c < (int)corners.size(); c++){
+        glm::vec2 corner(corners[c]);
+        for(int k = 0; k < ADAPTIVE_CORNER_RAYS + 4; k++){
+            // Sobol points, then the corners of the cell
+            glm::vec2 startPos(x + cellOffset(radicalInverse(k) ^ shiftX), y + cellOffset(sobol2(k) ^ shiftY));
+            if(k >= ADAPTIVE_CORNER_RAYS)
+                startPos = glm::vec2(x + cellOffset((k & 1) ? UINT32_MAX : 0), y + cellOffset((k & 2) ? UINT32_MAX : 0));
+            glm::vec2 toCorner = corner - startPos;
+            float distance = glm::length(toCorner);
+            toCorner /= distance;
+            // Turn the ray by the angle that moves it ADAPTIVE_CORNER_MISS beside the corner, both ways
+            float angle = (float)(ADAPTIVE_CORNER_MISS / distance);
+            for(int side = -1; side <= 1; side += 2){
+                float c = glm::cos(side * angle), s = glm::sin(side * angle);
+                glm::vec2 rayDir(toCorner.x * c - toCorner.y * s, toCorner.x * s + toCorner.y * c);
+                castRay(startPos, rayDir, glm::ivec2(x, y), tilemap, visibilityFlag);
+                numRays++;
+            }
+        }
+
+        // Lines through this corner and every corner found before it
+        glm::dvec2 p(corners[c]);
+        for(int other = 0; other < c; other++){
+            glm::dvec2 q(corners[other]);
+            glm::dvec2 dir = glm::normalize(q - p);
+            glm::dvec2 middle;
+            if(!chordMiddle(glm::ivec2(x, y), p, dir, middle))
+                continue;
+            double tp = glm::dot(p - middle, dir), tq = glm::dot(q - middle, dir);
+            if(tp * tq <= 0)
+                continue;
+            if(tp < 0)
+                dir = -dir;
+            // The line must pass the nearer corner on its way and reach the farther one
+            glm::ivec2 nearCorner = corners[c], farCorner = corners[other];
+            if(std::abs(tp) > std::abs(tq))
+                std::swap(nearCorner, farCorner);
+            if(entersWall(tilemap, nearCorner, -dir) || entersWall(tilemap, nearCorner, dir) || entersWall(tilemap, farCorner, -dir))
+                continue;
+
+            // Shift the line ADAPTIVE_CORNER_MISS to either side of both corners, or turn it about their
+            // middle so that it passes each one on a different side
+            glm::dvec2 normal(-dir.y, dir.x);
+            glm::dvec2 pivot = (p + q) * 0.5;
+            double angle = 2 * ADAPTIVE_CORNER_MISS / glm::length(q - p);
+            for(int variant = 0; variant < 4; variant++){
+                double side = (variant & 1) ? 1.0 : -1.0;
+                glm::dvec2 rayDir = dir, startPos = middle + normal * (side * ADAPTIVE_CORNER_MISS);
+                if(variant >= 2){
+                    rayDir = dir * glm::cos(side * angle) + normal * glm::sin(side * angle);
+                    startPos = pivot - rayDir * glm::dot(pivot - middle, dir);
+                }
+                if(startPos.x <= x + ray_eps || startPos.x >= x + 1 - ray_eps || startPos.y <= y + ray_eps || startPos.y >= y + 1 - ray_eps)
+                    continue;
+                castRay(glm::vec2(startPos), glm::vec2(rayDir), glm::ivec2(x, y), tilemap, visibilityFlag);
+                numRays++;
+            }
+        }
+    }
+    return numRays;
+}
+
+// Aim rays from the source cell at every untested cell next to a visible floor cell. Whatever is
+// seen next is one of them, and the cells visible through a narrow gap are rarely hit by rays
+// that are not aimed at them. A bundle of sightlines from the source to a target, however narrow,
+// can be moved until it touches two corners out of those of the two cells and the silhouette
+// corners of the walls, so the rays go along the lines through a corner of the source and one of
+// the target, and through a silhouette corner and a corner of the target, on top of rays between
+// random points of both cells. Returns the number of rays.
+
+int Visibility::traceFrontier(int x, int y, uint32_t shiftX, uint32_t shiftY, TileMap & tilemap, const std::vector<glm::ivec2> & corners, std::vector<uint8_t> & frontierTested, uint8_t * visibilityFlag){
+    int mapSizeX = tilemap.width;
+    int mapSizeY = tilemap.height;
+    int numRays = 0;
+
+    std::vector<int> targets;
+    for(int cell = 0; cell < mapSizeX * mapSizeY; cell++){
+        int floorX = cell % mapSizeX, floorY = cell / mapSizeX;
+        if(!visibilityFlag[cell] || tilemap.IsWall(floorX, floorY))
+            continue;
+        for(int dy = -1; dy <= 1; dy++){
+            for(int dx = -1; dx <= 1; dx++){
+                int nx = floorX + dx, ny = floorY + dy;
+                if(nx < 0 || ny < 0 || nx >= mapSizeX || ny >= mapSizeY)
+                    continue;
+                int neighbour = nx + ny * mapSizeX;
+                if(visibilityFlag[neighbour] || frontierTested[neighbour])
+                    continue;
+                frontierTested[neighbour] = 1;
+                targets.push_back(neighbour);
+            }
+        }
+    }
+
+    for(int target : targets){
+        int targetX = target % mapSizeX, targetY = target / mapSizeX;
+        // Corners of the target, just inside it. The insets differ on the two axes so that the
+        // lines from the corners of the source do not run through the corners of the grid.
+        glm::dvec2 targetCorners[4];
+        for(int k = 0; k < 4; k++){
+            targetCorners[k] = glm::dvec2(targetX + ((k & 1) ? 1 - ADAPTIVE_CORNER_MISS : ADAPTIVE_CORNER_MISS),
+                                          targetY + ((k & 2) ? 1 - ADAPTIVE_CORNER_MISS / 2 : ADAPTIVE_CORNER_MISS / 2));
+        }
+        for(int k = 0; k < 16; k++){
+            glm::vec2 startPos(x + cellOffset((k & 1) ? UINT32_MAX : 0), y + cellOffset((k & 2) ? UINT32_MAX : 0));
+            castRay(startPos, glm::normalize(glm::vec2(targetCorners[k >> 2]) - startPos), glm::ivec2(x, y), tilemap, visibilityFlag);
+            numRays++;
+        }
+
+        // A silhouette corner between the two cells is inside the box around both
+        int loX = std::min(x, targetX), hiX = std::max(x, targetX) + 1;
+        int loY = std::min(y, targetY), hiY = std::max(y, targetY) + 1;
+        for(const glm::ivec2 & corner : corners){
+            if(corner.x < loX || corner.x > hiX || corner.y < loY || corner.y > hiY)
+                continue;
+            glm::dvec2 p(corner);
+            for(const glm::dvec2 & q : targetCorners){
+                glm::dvec2 dir = glm::normalize(q - p);
+                glm::dvec2 middle;
+                if(!chordMiddle(glm::ivec2(x, y), p, dir, middle))
+                    continue;
+                // The line leaves the source, grazes the corner, then reaches the target
+                double tp = glm::dot(p - middle, dir), tq = glm::dot(q - middle, dir);
+                if(tp * tq <= 0 || std::abs(tp) > std::abs(tq))
+                    continue;
+                if(tp < 0)
+                    dir = -dir;
+                if(entersWall(tilemap, corner, -dir) || entersWall(tilemap, corner, dir))
+                    continue;
+                glm::dvec2 normal(-dir.y, dir.x);
+                for(int side = -1; side <= 1; side += 2){
+                    glm::dvec2 startPos = middle + normal * (side * ADAPTIVE_CORNER_MISS);
+                    if(startPos.x <= x + ray_eps || startPos.x >= x + 1 - ray_eps || startPos.y <= y + ray_eps || startPos.y >= y + 1 - ray_eps)
+                        continue;
+                    castRay(glm::vec2(startPos), glm::vec2(dir), glm::ivec2(x, y), tilemap, visibilityFlag);
+                    numRays++;
+                }
+            }
+        }
+
+        for(int k = 0; k < ADAPTIVE_FRONTIER_RAYS; k++){
+            // The two sequences swapped give a second, independent set of points for the targets
+            glm::vec2 startPos(x + cellOffset(radicalInverse(k) ^ shiftX), y + cellOffset(sobol2(k) ^ shiftY));
+            glm::vec2 aim(targetX + cellOffset(sobol2(k) ^ shiftX), targetY + cellOffset(radicalInverse(k) ^ shiftY));
+            castRay(startPos, glm::normalize(aim - startPos), glm::ivec2(x, y), tilemap, visibilityFlag);
+            numRays++;
+        }
+    }
+    return numRays;
+}
+
+// Trace rays that share a direction, in packets if the CPU allows it
+
+void Visibility::traceRays(const float * startX, const float * startY, int numRays, const glm::vec2 & rayDir, glm::ivec2 cell, TileMap & tilemap, const RayPacketTracer & tracer, uint8_t * visibilityFlag){
+    if(tracer.getISA() != RAY_PACKET_SCALAR){
+        tracer.trace(startX, startY, numRays, rayDir, cell, visibilityFlag);
+        return;
+    }
+    for(int i = 0; i < numRays; i++){
+        castRay(glm::vec2(startX[i], startY[i]), rayDir, cell, tilemap, visibilityFlag);
+    }
+}
+
+// Walk the cells crossed by the ray (Amanatides-Woo grid traversal) and flag them as visible,
+// stopping when the ray leaves the map or enters a wall. Any point on the ray is P = startPos + t * rayDir,
+// and the t of the next grid line on each axis is recomputed from the line index rather than accumulated,
+// so the crossings (and the visited cells) are exactly those of a walk over all sorted line intersections.
+
+void Visibility::castRay(const glm::vec2 & startPos, const glm::vec2 & rayDir, glm::ivec2 crt_pos, TileMap & tilemap, uint8_t * visibilityFlag){
+    int mapSizeX = tilemap.width;
+    int mapSizeY = tilemap.height;
+
+    visibilityFlag[crt_pos.x + crt_pos.y * mapSizeX] = 1;
+
+    // Rays (almost) parallel to an axis never cross that axis' grid lines
+    bool walkX = glm::abs(rayDir.x) > ray_eps;
+    bool walkY = glm::abs(rayDir.y) > ray_eps;
+    int stepX = (rayDir.x >= 0) ? 1 : -1;
+    int stepY = (rayDir.y >= 0) ? 1 : -1;
+
+    // First grid line in front of the start point, grid lines are the integers 0 .. mapSize-1
+    int lineX = (stepX > 0) ? (int)glm::ceil(startPos.x) : (int)glm::floor(startPos.x);
+    int lineY = (stepY > 0) ? (int)glm::ceil(startPos.y) : (int)glm::floor(startPos.y);
+    float tX = walkX ? (lineX - startPos.x) / rayDir.x : 0.0f;
+    float tY = walkY ? (lineY - startPos.y) / rayDir.y : 0.0f;
+
+    while(true){
+        walkX = walkX && lineX >= 0 && lineX < mapSizeX;
+        walkY = walkY && lineY >= 0 && lineY < mapSizeY;
+        if(!walkX && !walkY)
+            break;
+
+        // Take the closest crossing, X lines first on ties
+        bool crossX = walkX && (!walkY || tX <= tY);
+        float t = crossX ? tX : tY;
+        glm::vec2 candidate = startPos + t * rayDir;
+
+        // Out of bounds
+        if(candidate.x < 0 || candidate.y < 0 || candidate.x >= mapSizeX-ray_eps || candidate.y >= mapSizeY-ray_eps)
+            break;
+
+        if(crossX){
+            crt_pos.x += stepX;
+            lineX += stepX;
+            tX = (lineX - startPos.x) / rayDir.x;
+        }
+        else{
+            crt_pos.y += stepY;
+            lineY += stepY;
+            tY = (lineY - startPos.y) / rayDir.y;
+        }
+
+        // Out of bounds
+        if(crt_pos.x < 0 || crt_pos.y < 0 || crt_pos.x >= mapSizeX || crt_pos.y >= mapSizeY)
+            break;
+
+        visibilityFlag[crt_pos.x + crt_pos.y * mapSizeX] = 1;
+
+        if(tilemap.IsWall(crt_pos.x, crt_pos.y))
+            break;
+    }
+}
+
+// Exact visibility, swept in line space. Every sightline leaves the source in one of 8 octants of
+// directions; mirrored and transposed into the first one, it is y = c + m x with 0 < m < 1, the
+// source cell at the origin, and it crosses the columns in order, going up within each. The lines
+// through the source form a convex polygon of (m, c). The line touches the walls of rows r1 to r2
+// of column k if it enters the column below r2 + 1 and leaves it above r1, a strip of (m, c)
+// bounded by two lines. So the lines that clear columns 0 to k are convex polygons, one per
+// sequence of gaps between the walls, and each column splits them by its gaps. A cell is seen if
+// some line enters its column through it, or enters the gap below it and leaves the column above
+// its bottom. Polygons of no area are grazing lines, which touch a wall, and are dropped.
+
+void Visibility::computeCellVisibilityExact(int x, int y, TileMap & tilemap, uint8_t * visibilityFlag){
+    for(int i = 0; i < tilemap.width * tilemap.height; i++){
+        visibilityFlag[i] = 0;
+    }
+    visibilityFlag[x + y * tilemap.width] = 1;
+    ExactScratch scratch;
+    for(int octant = 0; octant < 8; octant++){
+        sweepOctant(x, y, octant, tilemap, scratch, visibilityFlag);
+    }
+}
+
+// Area of a polygon, positive if counter-clockwise
+static double polygonArea(const glm::dvec2 * polygon, int n){
+    double area = 0;
+    for(int i = 0; i < n; i++){
+        const glm::dvec2 & p0 = polygon[i];
+        const glm::dvec2 & p1 = polygon[(i + 1) % n];
+        area += p0.x * p1.y - p1.x * p0.y;
+    }
+    return area / 2;
+}
+
+// Append to out the part of the convex polygon where a * m + b * c + d > 0, and return its number
+// of vertices, 0 if it has no area
+static int clipPolygon(const glm::dvec2 * polygon, int n, double a, double b, double d, std::vector<glm::dvec2> & out){
+    size_t begin = out.size();
+    for(int i = 0; i < n; i++){
+        const glm::dvec2 & p0 = polygon[i];
+        const glm::dvec2 & p1 = polygon[(i + 1) % n];
+        double f0 = a * p0.x + b * p0.y + d;
+        double f1 = a * p1.x + b * p1.y + d;
+        if(f0 > 0)
+            out.push_back(p0);
+        if((f0 > 0) != (f1 > 0))
+            out.push_back(p0 + (p1 - p0) * (f0 / (f0 - f1)));
+    }
+    int count = (int)(out.size() - begin);
+    if(count < 3 || polygonArea(&out[begin], count) <= EXACT_EPS){
+        out.resize(begin);
+        return 0;
+    }
+    return count;
+}
+
+void Visibility::sweepOctant(int x, int y, int octant, TileMap & tilemap, ExactScratch & scratch, uint8_t * visibilityFlag){
+    int mapSizeX = tilemap.width;
+    int mapSizeY = tilemap.height;
+    int signX = (octant & 1) ? -1 : 1;
+    int signY = (octant & 2) ? -1 : 1;
+    bool transpose = (octant & 4) != 0;
+    // Cell of the map at column k and row r of the octant, false outside the map
+    auto mapCell = [&](int k, int r, glm::ivec2 & cell){
+        cell = transpose ? glm::ivec2(x + signX * r, y + signY * k) : glm::ivec2(x + signX * k, y + signY * r);
+        return cell.x >= 0 && cell.y >= 0 && cell.x < mapSizeX && cell.y < mapSizeY;
+    };
+    auto isWall = [&](int k, int r){
+        glm::ivec2 cell;
+        return !mapCell(k, r, cell) || tilemap.IsWall(cell.x, cell.y);
+    };
+    auto markRows = [&](int k, int r0, int r1){
+        glm::ivec2 cell;
+        for(int r = r0; r <= r1; r++){
+            if(mapCell(k, r, cell))
+                visibilityFlag[cell.x + cell.y * mapSizeX] = 1;
+        }
+    };
+
+    // The lines through the source: 0 < m < 1, c < 1 and c + m > 0
+    int cur = 0;
+    scratch.vertices[cur] = {glm::dvec2(0, 0), glm::dvec2(1, -1), glm::dvec2(1, 1), glm::dvec2(0, 1)};
+    scratch.first[cur] = {0, 4};
+    glm::ivec2 cell;
+    for(int k = 0; scratch.first[cur].size() > 1 && mapCell(k, 0, cell); k++){
+        std::vector<glm::dvec2> & next = scratch.vertices[!cur];
+        std::vector<uint32_t> & nextFirst = scratch.first[!cur];
+        next.clear();
+        nextFirst.assign(1, 0);
+        for(size_t p = 0; p + 1 < scratch.first[cur].size(); p++){
+            const glm::dvec2 * polygon = &scratch.vertices[cur][scratch.first[cur][p]];
+            int n = (int)(scratch.first[cur][p + 1] - scratch.first[cur][p]);
+            // Heights at which the lines enter and leave the column
+            double enterMin = HUGE_VAL, enterMax = -HUGE_VAL, leaveMax = -HUGE_VAL;
+            for(int i = 0; i < n; i++){
+                double enter = polygon[i].y + polygon[i].x * k;
+                enterMin = glm::min(enterMin, enter);
+                enterMax = glm::max(enterMax, enter);
+                leaveMax = glm::max(leaveMax, enter + polygon[i].x);
+            }
+            // The lines leave the source through column 0, its rows from 1 on come after it
+            int rowLo = (k == 0) ? 1 : (int)glm::floor(enterMin + EXACT_EPS);
+            int rowHi = (int)glm::ceil(leaveMax - EXACT_EPS) - 1;
+            if(k > 0)
+                markRows(k, rowLo, (int)glm::ceil(enterMax - EXACT_EPS) - 1);
+
+            // Gaps between the walls of the rows the lines reach, the last one open above
+            double bottom = -HUGE_VAL;
+            int r = rowLo;
+            while(true){
+                while(r <= rowHi && !isWall(k, r))
+                    r++;
+                bool wall = r <= rowHi;
+                double top = wall ? r : HUGE_VAL;
+                int m = n;
+                const glm::dvec2 * gap = polygon;
+                if(bottom > -HUGE_VAL){
+                    scratch.clipped[0].clear();
+                    m = clipPolygon(gap, m, k, 1, -bottom, scratch.clipped[0]);
+                    gap = scratch.clipped[0].data();
+                }
+                if(m > 0 && wall){
+                    scratch.clipped[1].clear();
+                    m = clipPolygon(gap, m, -k, -1, top, scratch.clipped[1]);
+                    gap = scratch.clipped[1].data();
+                }
+                if(m > 0){
+                    // The lines that enter the gap see up to the wall above it
+                    double gapEnter = HUGE_VAL, gapLeave = -HUGE_VAL;
+                    for(int i = 0; i < m; i++){
+                        gapEnter = glm::min(gapEnter, gap[i].y + gap[i].x * k);
+                        gapLeave = glm::max(gapLeave, gap[i].y + gap[i].x * (k + 1));
+                    }
+                    int seenHi = (int)glm::ceil(gapLeave - EXACT_EPS) - 1;
+                    markRows(k, glm::max((int)glm::floor(gapEnter + EXACT_EPS), rowLo), wall ? glm::min(seenHi, r) : seenHi);
+                    // and those that leave it below the wall go on to the next column
+                    int kept = m;
+                    if(wall)
+                        kept = clipPolygon(gap, m, -(k + 1), -1, top, next);
+                    else
+                        next.insert(next.end(), gap, gap + m);
+                    if(kept > 0)
+                        nextFirst.push_back((uint32_t)next.size());
+                }
+                if(!wall)
+                    break;
+                while(r <= rowHi && isWall(k, r))
+                    r++;
+                bottom = r;
+            }
+        }
+        cur = !cur;
+    }
+}
@@ -1,162 +1,115 @@
 #ifndef VISIBILITY_H
 #define VISIBILITY_H
 #include <glm/glm.hpp>
-#include <fstream>
-#include <iostream>
-#include <utility>
+#include <stdint.h>
 #include <vector>
-#include <algorithm>
-#include <stdio.h>
-#include <random>
-
-#define _USE_MATH_DEFINES
-#include <math.h>
+#include <functional>
 
 #include "TileMap.h"
+#include "RayPacket.h"
+#include "PVS.h"
 
 #define ray_eps 1e-5
 
+// Precomputes the cell-to-cell potentially visible set (PVS) of a tilemap by shooting
+// rays from every cell, and writes it in the binary format read by PVS. Source cells are
+// independent, so they are spread over a pool of worker threads; each cell seeds its own
+// RNG from its index, so the output does not depend on the number of threads.
+
+struct VisibilitySettings{
+    int numThreads = 1;
+    // Visibility is symmetric: shoot rays over half the circle only and OR every row with
+    // its column. Half the rays, but the whole matrix is held in memory before writing.
+    bool symmetric = false;
+    // Replace the ray sampling by the exact cell-to-cell test below
+    bool exact = false;
+    // Shoot batches of low-discrepancy rays until convergedBatches batches in a row find no new
+    // cell, plus rays past the wall corners, instead of 800 directions x 100 random origins
+    bool adaptive = false;
+    int convergedBatches = 4;
+    // If set, the number of rays of every source cell is written to this file
+    const char* rayReport = nullptr;
+    // Share one row between the cells of square regions up to regionSize cells wide that are only
+    // floor or only walls, instead of one row per cell. 0 for one row per cell.
+    int regionSize = 0;
+    // Split every row into this many heading sectors, so the renderer only reads the sectors in
+    // front of the camera, and drop the cells farther than maxDistance cells (0 keeps them all)
+    int sectors = 1;
+    float maxDistance = 0;
+    // Widest SIMD kernel the sampler may trace its rays with, if the CPU supports it
+    RayPacketISA simd = RAY_PACKET_AVX2;
+    // Update the PVS of an older version of the map instead of recomputing it, see updateVisibility
+    bool incremental = true;
+    // Compute the rows of the cells around the camera at runtime instead of the whole PVS, see LazyPVS.
+    // Up to cachedRows of them are kept in memory.
+    bool lazy = false;
+    int cachedRows = 1024;
+    // Find the visible cells every frame through the portals between the rooms of the map, without
+    // a PVS, see PortalGraph
+    bool portals = false;
+    // Compute the sources in numShards shard files that are merged once all are done, so a killed
+    // run resumes where it stopped. shard >= 0 computes only that shard, for one of several processes.
+    int numShards = 1;
+    int shard = -1;
+};
+
 class Visibility{
 public:
-    enum PlaneType{
-        POS_X,
-        POS_Y,
-        NEG_X, NEG_Y
-    };
-
-    void computeVisibility(const char* outFile, TileMap & tilemap){
-        printf("Computing cell visibility...\n");
-        int mapSizeX = tilemap.width;
-        int mapSizeY = tilemap.height;
-
-        std::ofstream out(outFile);
-
-        uint8_t * visibilityFlag;
-        visibilityFlag = (uint8_t *)malloc(mapSizeX * mapSizeY * sizeof(uint8_t));
-
-        std::default_random_engine generator;
-        std::uniform_real_distribution<float> randDist(0.0 + ray_eps, 1.0 - ray_eps);
-
-        std::vector<uint32_t> visibleCells;
-
-        for (int x = 0; x < mapSizeX; x++)
-        {
-            for (int y = 0; y < mapSizeY; y++)
-            {
-                for(int i=0;i<mapSizeX * mapSizeY; i++){
-                    visibilityFlag[i] = 0;
-                }
-                // Compute for each cell the visibility to other cells
-                visibleCells.clear();
-                for(float theta = 0; theta < 2 * M_PI; theta+=(2 * M_PI / 800)){
-                    // Uniform structured sample of rays from the current cell
-
-                    for(int samplePoint = 0; samplePoint < 100; samplePoint++){
-                        // Uniform random sampling of points inside the cess from which to shoot the rays from
-
-                        glm::vec2 startPos(x + randDist(generator), y + randDist(generator));
-                        glm::vec2 rayDir = glm::normalize(glm::vec2(glm::sin(theta), glm::cos(theta)));
-
-                        // Parameterize all "plane" (actually grid lines) intersections with ray as a function of t
-                        // As any point on the ray is defined as P = startPos + t * rayDir
-                        // We want to find the t's corresponding to the ray intersections with the cell walls
-                        // Then, order them in ascending order and start traversing
-                        
-                        float t = 0.0f;
-
-                        std::vector<std::pair<float, PlaneType>> intersections;
-
-                        // X planes
-                        if(glm::abs(rayDir.x) > ray_eps){
-                            for (int dx = 0; dx < mapSizeX; dx++)
-                            {
-                                t = (dx - startPos.x) / rayDir.x;
-                                bool positiveRayDirection = (rayDir.x >= 0);
-                                bool positiveT = (t >= 0);
-                                std::pair<float, PlaneType> intersection;
-                                if(positiveRayDirection && positiveT){
-                                    intersection = std::pair<float, PlaneType>(t, POS_X);
-                                }
-                                else{
-                                    intersection = std::pair<float, PlaneType>(t, NEG_X);
-                                }
-                                intersections.push_back(intersection);
-                            }
-                        }
-
-                        // Y planes
-                        if(glm::abs(rayDir.y) > ray_eps){
-                            for (int dy = 0; dy < mapSizeY; dy++)
-                            {
-                                t = (dy - startPos.y) / rayDir.y;
-                                bool positiveRayDirection = (rayDir.y >= 0);
-                                bool positiveT = (t >= 0);
-                                std::pair<float, PlaneType> intersection;
-                                if(positiveRayDirection && positiveT){
-                                    intersection = std::pair<float, PlaneType>(t, POS_Y);
-                                }
-                                else{
-                                    intersection = std::pair<float, PlaneType>(t, NEG_Y);
-                                }
-                                intersections.push_back(intersection);
-                            }
-                        }
-
-                        std::sort(intersections.begin(), intersections.end(),
-                                [](const std::pair<float, PlaneType> a, const std::pair<float, PlaneType> b) -> bool
-                                {
-                                    return a.first < b.first;
-                                });
-                        
-                        // Walk through the intersections and compute visible cells
-                        glm::ivec2 crt_pos(x, y);
-                        visibilityFlag[crt_pos.x + crt_pos.y * mapSizeX] = 1;
-                        for(auto intersection : intersections){
-                            float t = intersection.first;
-                            glm::vec2 candidate = startPos + t * rayDir;
-
-                            // Only interested in the positive ray direction
-                            if(t < 0)
-                                continue;
-
-                            // Out of bounds
-                            if(candidate.x < 0 || candidate.y < 0 || candidate.x >= mapSizeX-ray_eps || candidate.y >= mapSizeY-ray_eps)
-                                break;
-
-                            switch(intersection.second){
-                                case POS_X: crt_pos += glm::ivec2( 1,  0); break;
-                                case NEG_X: crt_pos += glm::ivec2(-1,  0); break;
-                                case POS_Y: crt_pos += glm::ivec2( 0,  1); break;
-                                case NEG_Y: crt_pos += glm::ivec2( 0, -1); break;
-                            }
-
-                            // Out of bounds
-                            if(crt_pos.x < 0 || crt_pos.y < 0 || crt_pos.x >= mapSizeX || crt_pos.y >= mapSizeY)
-                                break;
-
-                            
-                            visibilityFlag[crt_pos.x + crt_pos.y * mapSizeX] = 1;
-
-                            if(tilemap.GetTile(crt_pos.x, crt_pos.y) == 0)
-                                break;
-                        }
-                    }
-                }
-                for(int i=0;i < mapSizeX * mapSizeY; i++){
-                    out << (int)visibilityFlag[i] << " ";
-                }
-                out << std::endl;
-            }
-        }
-        out.close();
-        free(visibilityFlag);
-        printf("Cell visibility done...\n");
-    }
-
     Visibility(){
     }
     ~Visibility(){
     }
+
+    void computeVisibility(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings);
+    // Rewrite a PVS file computed for another version of the tilemap, recomputing only the rows
+    // the edited tiles can change. Returns false if the file cannot be updated (missing, other
+    // dimensions or settings), in which case it has to be computed from scratch.
+    bool updateVisibility(const char* pvsFile, TileMap & tilemap, const VisibilitySettings & settings);
+    // Compute the packed row of one source cell (x * height + y) on the calling thread
+    void computeCellRow(int cell, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint64_t * row);
+
+    // PVS header flags of the rows computed with these settings
+    static uint32_t fileFlags(const VisibilitySettings & settings);
+    // Ray counts of the sampler the rows are computed with, 0 for those it does not use
+    struct SamplerSettings{
+        uint32_t convergedBatches;
+        uint32_t raysPerDirection;
+        uint32_t adaptiveDirections, adaptiveOrigins, adaptiveCornerRays, adaptiveFrontierRays;
+        float adaptiveCornerMiss;
+    };
+    static SamplerSettings samplerSettings(const VisibilitySettings & settings);
+
+private:
+    typedef std::function<void(int cell, std::vector<uint64_t> & row)> RowCallback;
+
+    void writeVisibility(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions, const std::function<void(const RowCallback &)> & produceRows);
+    bool computeShards(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions);
+    bool mergeShards(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions);
+    std::vector<bool> finishedShards(const char* outFile, TileMap & tilemap, const VisibilitySettings & settings, int numSources, int numShards);
+    static int shardBegin(int shard, int numSources, int numShards);
+    void buildRegions(TileMap & tilemap, int regionSize, std::vector<PVSRegion> & regions);
+    void addRegions(TileMap & tilemap, int regionSize, int x, int y, int size, std::vector<PVSRegion> & regions);
+    void computeRows(TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions, const std::vector<int> & sources, const RowCallback & storeRow);
+    void reportRays(TileMap & tilemap, const VisibilitySettings & settings, const std::vector<PVSRegion> & regions, const std::vector<int> & sources, const std::vector<int> & raysPerRow);
+    void splitSectors(const PVSRegion & source, const uint64_t * row, TileMap & tilemap, const VisibilitySettings & settings, std::vector<uint64_t> & sectorRows);
+    int computeRegionVisibility(const PVSRegion & region, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint8_t * visibilityFlag, std::vector<uint8_t> & cellFlag);
+    int computeCellVisibility(int x, int y, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint8_t * visibilityFlag);
+    int computeCellVisibilityAdaptive(int x, int y, TileMap & tilemap, const VisibilitySettings & settings, const RayPacketTracer & tracer, uint8_t * visibilityFlag);
+    int traceCorners(int x, int y, uint32_t shiftX, uint32_t shiftY, TileMap & tilemap, std::vector<uint8_t> & cornerTested, std::vector<glm::ivec2> & corners, uint8_t * visibilityFlag);
+    int traceFrontier(int x, int y, uint32_t shiftX, uint32_t shiftY, TileMap & tilemap, const std::vector<glm::ivec2> & corners, std::vector<uint8_t> & frontierTested, uint8_t * visibilityFlag);
+    void traceRays(const float * startX, const float * startY, int numRays, const glm::vec2 & rayDir, glm::ivec2 cell, TileMap & tilemap, const RayPacketTracer & tracer, uint8_t * visibilityFlag);
+    void castRay(const glm::vec2 & startPos, const glm::vec2 & rayDir, glm::ivec2 crt_pos, TileMap & tilemap, uint8_t * visibilityFlag);
+
+    // Exact visibility: cell B is visible from cell A if some segment from the inside of A to the
+    // inside of B touches no wall tile other than A and B
+    struct ExactScratch{
+        // Convex polygons of lines, polygon i has the vertices first[i] to first[i + 1]. The
+        // polygons of a column are written into the other buffer from those of the column before.
+        std::vector<glm::dvec2> vertices[2], clipped[2];
+        std::vector<uint32_t> first[2];
+    };
+    void computeCellVisibilityExact(int x, int y, TileMap & tilemap, uint8_t * visibilityFlag);
+    void sweepOctant(int x, int y, int octant, TileMap & tilemap, ExactScratch & scratch, uint8_t * visibilityFlag);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -4,7 +4,8 @@
 #include "Simplifier.h"
 #include <stdlib.h>
 #include "TileMap.h"
-#include <filesystem>
+#include "PVS.h"
+#include <thread>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -142,6 +143,87 @@ int main(int argc, char **argv)
 	glewExperimental = GL_TRUE;
 	glewInit();
 
+	// Options of the visibility precomputation:
+	//   -j <threads>  number of worker threads, also for simplify
+	//   -symmetric    trace half the rays and make the visibility symmetric
+	//   -exact        exact cell-to-cell visibility instead of ray sampling
+	//   -full         recompute the whole PVS after an edit of the map instead of updating it
+	//   -adaptive     sample every cell with low-discrepancy rays until it converges
+	//   -converge <n> batches without a new visible cell after which -adaptive stops (default 4)
+	//   -rayreport <file>  write the number of rays of every cell to the file
+	//   -simd <isa>   widest ray packet kernel to use: scalar, sse4.1 or avx2 (default)
+	//   -regions <n>  one row per region of up to n x n cells instead of one per cell
+	//   -sectors <n>  split every row into n heading sectors (8 or 16), read only those in view
+	//   -maxdist <d>  drop the cells farther than d cells from the PVS
+	//   -portals      find the visible rooms through their doorways every frame, no PVS needed
+	//   -shards <n>   compute the PVS in n resumable shards, merged once all are done
+	//   -shard <k>    compute only shard k, to spread the shards over several processes
+	//   -lazy         compute the rows around the camera while rendering, cached in visibility.cache
+	//   -cacherows <n>  rows -lazy keeps in memory (default 1024)
+	// Options of simplify:
+	//   -engine <name>  make the LODs by clustering (default) or collapse (edge collapses)
+	//   -lods <n>     number of LODs, from the whole mesh down to -minfaces faces (default 4)
+	//   -minfaces <n> faces of the coarsest LOD (default 1000)
+	// 'benchoctree <mesh>' times the octree build of the mesh on 1, 2, 4, ... 64 threads instead
+	VisibilitySettings visibilitySettings;
+	SimplifierSettings simplifierSettings;
+	int numLODs = 4;
+	visibilitySettings.numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+	int numArgs = 1;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			visibilitySettings.numThreads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-symmetric") == 0)
+			visibilitySettings.symmetric = true;
+		else if(strcmp(argv[i], "-exact") == 0)
+			visibilitySettings.exact = true;
+		else if(strcmp(argv[i], "-full") == 0)
+			visibilitySettings.incremental = false;
+		else if(strcmp(argv[i], "-adaptive") == 0)
+			visibilitySettings.adaptive = true;
+		else if(strcmp(argv[i], "-converge") == 0 && i + 1 < argc)
+			visibilitySettings.convergedBatches = std::max(1, atoi(argv[++i]));
+		else if(strcmp(argv[i], "-rayreport") == 0 && i + 1 < argc)
+			visibilitySettings.rayReport = argv[++i];
+		else if(strcmp(argv[i], "-regions") == 0 && i + 1 < argc)
+			visibilitySettings.regionSize = std::max(0, atoi(argv[++i]));
+		else if(strcmp(argv[i], "-sectors") == 0 && i + 1 < argc)
+			visibilitySettings.sectors = std::max(1, atoi(argv[++i]));
+		else if(strcmp(argv[i], "-maxdist") == 0 && i + 1 < argc)
+			visibilitySettings.maxDistance = std::max(0.0, atof(argv[++i]));
+		else if(strcmp(argv[i], "-portals") == 0)
+			visibilitySettings.portals = true;
+		else if(strcmp(argv[i], "-shards") == 0 && i + 1 < argc)
+			visibilitySettings.numShards = std::max(1, atoi(argv[++i]));
+		else if(strcmp(argv[i], "-shard") == 0 && i + 1 < argc)
+			visibilitySettings.shard = atoi(argv[++i]);
+		else if(strcmp(argv[i], "-lazy") == 0)
+			visibilitySettings.lazy = true;
+		else if(strcmp(argv[i], "-cacherows") == 0 && i + 1 < argc)
+			visibilitySettings.cachedRows = std::max(1, atoi(argv[++i]));
+		else if(strcmp(argv[i], "-engine") == 0 && i + 1 < argc){
+			i++;
+			if(strcmp(argv[i], "collapse") == 0)
+				simplifierSettings.engine = SIMPLIFIER_EDGE_COLLAPSE;
+			else if(strcmp(argv[i], "clustering") == 0)
+				simplifierSettings.engine = SIMPLIFIER_CLUSTERING;
+		}
+		else if(strcmp(argv[i], "-lods") == 0 && i + 1 < argc)
+			numLODs = std::max(1, atoi(argv[++i]));
+		else if(strcmp(argv[i], "-minfaces") == 0 && i + 1 < argc)
+			simplifierSettings.minFaces = std::max(1, atoi(argv[++i]));
+		else if(strcmp(argv[i], "-simd") == 0 && i + 1 < argc){
+			i++;
+			for(RayPacketISA isa : {RAY_PACKET_SCALAR, RAY_PACKET_SSE41, RAY_PACKET_AVX2}){
+				if(strcmp(argv[i], RayPacketTracer::isaName(isa)) == 0)
+					visibilitySettings.simd = isa;
+			}
+		}
+		else
+			argv[numArgs++] = argv[i];
+	}
+	argc = numArgs;
+
 	// Load image for tilemap
 	int w, h, comp;
 	uint8_t* img = stbi_load(  "../../map/tilemap.bmp", &w, &h, &comp, 3);
@@ -149,9 +231,11 @@ int main(int argc, char **argv)
 	printf("Tilemap height: %d\n", w);
 	printf("Tilemap comp: %d\n", comp);
 	TileMap map(img, w, h, comp);
+	stbi_image_free(img);
 	
 	// Application instance initialization
-	Application::instance().init(map, !std::filesystem::exists("../../map/visibility.txt"));
+	bool computeViz = !PVS::isValid("../../map/visibility.pvs", map, visibilitySettings);
+	Application::instance().init(std::move(map), computeViz, visibilitySettings);
 	if(argc == 1){
 		Application::instance().loadMesh("../../models/moai", 38);
 		Application::instance().loadMesh("../../models/dragon", 59);
@@ -166,10 +250,17 @@ int main(int argc, char **argv)
 		printf("Starting LOD generation...\n");
 		Simplifier::instance().loadMesh(argv[2]);
 		printf("Computing LOD...\n");
-		Simplifier::instance().computeLODs(4);
+		simplifierSettings.numThreads = std::max(1, visibilitySettings.numThreads);
+		Simplifier::instance().computeLODs(numLODs, simplifierSettings);
 		printf("Done...\n");
 		return 0;
 	}
+	else if(argc == 3 && strcmp(argv[1], "benchoctree") == 0){
+		// Thread scaling of the octree build, up to -j threads if more than 64 are asked for
+		Simplifier::instance().loadMesh(argv[2]);
+		bool identical = Simplifier::instance().benchmarkOctree(std::max(64, visibilitySettings.numThreads), 5);
+		return identical ? 0 : 1;
+	}
 	else{
 		printf("Incorrect usage!\n");
 		return 0;